@@ -0,0 +1,36 @@
+// Core map: one entry per physical page that kalloc() hands out,
+// recording which process maps it as user memory and where, so that
+// page replacement can choose among all of the system's pages and
+// find the PTE to undo (a reverse mapping). The NFRAME ordinary
+// frames come first, then the frames of the NMEGAPAGE megapages.
+// A megapage mapped whole is entered at its first frame only, with
+// FRAME_MEGA; once split, each of its pages has an entry of its own.
+
+struct frame {
+  struct proc *owner;  // process that maps this page, if FRAME_USER
+  uint64 va;           // where owner maps it
+  int seq;             // when it was mapped, in system-wide order
+  int age;             // aging counter (system-wide Aging policy)
+  int slot;            // swap slot holding a copy of the page, or -1
+  int ref;             // references: page table mappings, or kalloc()'s caller
+  int flags;           // FRAME_* bits
+};
+
+#define FRAME_USER   0x1  // mapped user page; owner and va are valid
+#define FRAME_SHARED 0x2  // shared copy-on-write at va; no single owner
+#define FRAME_MEGA   0x4  // first frame of a megapage mapped whole at va
+#define FRAME_UNSHARED 0x8  // was shared, one user left; its owner not yet found
+
+#define MEGAFRAMES (MEGAPGSIZE / PGSIZE)              // frames in a megapage
+#define NCOREFRAME (NFRAME + NMEGAPAGE*MEGAFRAMES)    // entries in the core map
+
+struct coremap {
+  struct spinlock lock;  // protects the entries and nextseq
+  struct frame frames[NCOREFRAME];
+  int nextseq;           // next sequence number
+  int nunshared;         // FRAME_UNSHARED entries
+  int hand;              // clock hand (system-wide Clock policy)
+  struct spinlock picklock;  // one global replacement pick at a time
+};
+
+extern struct coremap coremap;
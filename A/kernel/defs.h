@@ -1,9 +1,13 @@
 struct buf;
 struct context;
 struct file;
+struct frame;
 struct inode;
+struct kalloc_stat;
+struct vmstat;
 struct pipe;
 struct proc;
+struct segment;
 struct spinlock;
 struct sleeplock;
 struct stat;
@@ -58,7 +62,27 @@ void            ireclaim(int);
 // kalloc.c
 void*           kalloc(void);
 void            kfree(void *);
+void*           kalloc_zeroed(void);
+int             kzero_idle(void);
+void            kzerod(void);
+int             kfreepages(void);
+void*           kalloc_mega(void);
+void*           kalloc_mega_zeroed(void);
+void            kmega_setsplit(void*, void*);
+void*           kmega_split(void*);
+void            kfree_mega(void*);
 void            kinit(void);
+void            kdup(void *);
+int             krefcount(void *);
+void            kallocstat(struct kalloc_stat*);
+struct frame*   pa2frame(uint64);
+uint64          frame2pa(struct frame*);
+void            frame_map(uint64, struct proc*, uint64);
+void            frame_map_mega(uint64, struct proc*, uint64);
+void            frame_unmap(uint64);
+void            frame_disown(uint64);
+void            frame_set_slot(uint64, int);
+int             frame_take_slot(uint64);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -95,6 +119,7 @@ void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
+void            kthread_create(char*, void (*)(void));
 int             kwait(uint64);
 void            wakeup(void*);
 void            yield(void);
@@ -163,7 +188,10 @@ void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
 pte_t *         walk(pagetable_t, uint64, int);
+pte_t *         walkleaf(pagetable_t, uint64, int*);
+int             mapmega(pagetable_t, uint64, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
+uint64          uvmnext(pagetable_t, uint64, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
@@ -179,25 +207,69 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_rwv(struct buf *, char **, int, uint, int);
 void            virtio_disk_intr(void);
 
 // swap.c
-int             swap_init(struct proc*);
-void            swap_cleanup(struct proc*);
-int             swap_slot_is_used(struct proc*, int);
-void            swap_slot_set_used(struct proc*, int);
-void            swap_slot_set_free(struct proc*, int);
-int             swap_alloc_slot(struct proc*);
-int             swap_out_page(struct proc*, uint64, uint64);
-int             swap_in_page(struct proc*, uint64, uint64, int);
+void            swapinit(int, struct superblock*);
+void            swap_stat(struct vmstat*);
+void            swap_dup(int);
+int             swap_alloc_slot(int);
+void            swap_free_slot(int);
+void            swap_write_pages(char**, int, int);
+int             swap_in_pages(struct proc*, uint64, char**, int, int);
+
+// zswap.c
+void            zswapinit(void);
+int             zswap_put(int, char*);
+int             zswap_get(int, char*);
+void            zswap_drop(int);
+int             zswap_oldest(void);
+int             zswap_copy(int, char*);
+void            zswap_stat(struct vmstat*);
 
 // demand.c
+struct segment* find_segment(struct proc*, uint64);
+void            log_page_alloc(struct proc*, uint64, int);
 uint64          demand_page_fault(struct proc*, uint64, int, int);
 uint64          demand_page_fault_with_pagetable(struct proc*, pagetable_t, uint64, int, int);
+void            resident_drop_range(struct proc*, uint64, uint64);
+void            frame_map_range(struct proc*, uint64, uint64);
+int             get_page_seq(struct proc*, uint64);
+int             get_page_age(struct proc*, uint64);
+int             proc_policy(struct proc*);
+int             ksetpolicy(int, int);
+int             ksetfaultaround(int, int);
+void            kswapdinit(void);
+void            kswapd(void);
+int             ksetwatermarks(int, int, int);
+int             kmadvise(struct proc*, uint64, int, int);
+void            advice_clip(struct proc*, uint64);
+uint64          kmmap(struct proc*, struct inode*, uint, uint, int, int);
+void            mmap_release(struct proc*, uint64);
+void            reclaim_stat(struct vmstat*);
+
+// pcache.c
+void            pcacheinit(void);
+uint64          pcache_get(struct inode*, uint, uint);
+int             pcache_put(struct inode*, uint, uint, uint64);
+int             pcache_shrink(void);
+void            pcache_invalidate(struct inode*);
 
 // dirty.c
 int             mark_page_dirty(struct proc*, uint64);
-int             handle_write_fault(struct proc*, uint64);
+int             page_is_dirty(pagetable_t, uint64);
+int             handle_write_fault(struct proc*, pte_t*, uint64);
+int             may_write(struct proc*, uint64);
+
+// vmtrace.c
+extern int      vmverbose;
+void            vmtraceinit(void);
+void            vmlog(struct proc*, int, uint64, int, int);
+int             vmtrace_read(uint64, int);
+void            vmstat(struct vmstat*);
+void            vmlatency(int, uint64);
+int             vmlatency_read(uint64);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
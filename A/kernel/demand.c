@@ -3,8 +3,17 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
+#include "fs.h"
+#include "file.h"
+#include "memstat.h"
+#include "coremap.h"
+#include "vmtrace.h"
+#include "fcntl.h"
+
+extern struct proc proc[NPROC];
 
 // Forward declaration
 int flags2perm(int flags);
@@ -19,17 +28,20 @@ struct segment* find_segment(struct proc *p, uint64 va) {
   return 0;
 }
 
-// Determine the cause of the page fault
-const char* get_fault_cause(struct proc *p, uint64 va, int is_write, int is_exec) {
-  if(va >= MAXVA) return "invalid";
+// Determine the cause of a page fault at va: the VT_* code of
+// the segment or region holding it, or VT_INVALID for a hole.
+static int fault_cause(struct proc *p, uint64 va, int is_exec) {
+  if(va >= MAXVA) return VT_INVALID;
   
   // Check if it's in a text/data segment
   struct segment *seg = find_segment(p, va);
   if(seg) {
-    if(seg->flags & 0x1) {
-      return "text";
+    if(seg->ip) {
+      return VT_MMAP;
+    } else if(seg->flags & 0x1) {
+      return VT_TEXT;
     } else {
-      return "data";
+      return VT_DATA;
     }
   }
   
@@ -37,76 +49,510 @@ const char* get_fault_cause(struct proc *p, uint64 va, int is_write, int is_exec
   if(p->num_segments == 0) {
     // Common memory layout: text at 0x0, data at 0x1000
     if(va == 0x0 && is_exec) {
-      return "text";  // Text segment at 0x0
+      return VT_TEXT;  // Text segment at 0x0
     } else if(va >= 0x1000 && va < 0x2000) {
-      return "data";  // Data segment around 0x1000
+      return VT_DATA;  // Data segment around 0x1000
     }
   }
   
-  // Stack region starts right after heap ends  
-  uint64 stack_start = p->heap_start;
+  // exec puts the stack, below its guard page, right after the
+  // program; sbrk grows the heap upward from there.
+  uint64 heap = p->heap_start + (USERSTACK+1)*PGSIZE;
   
-  // Check if it's in stack region (from heap_start to process size)
-  if(va >= stack_start && va < p->sz) {
-    return "stack";
+  if(va >= heap && va < p->sz) {
+    return VT_HEAP;
+  }
+  if(va >= p->heap_start && va < heap) {
+    return VT_STACK;
   }
   
-  // Note: heap grows upward from heap_start via sbrk, 
-  // but we handle that differently since exec sets stack area
-  
-  return "invalid";
+  return VT_INVALID;
+}
+
+// The VT_* code for an access
+static int access_code(int is_write, int is_exec) {
+  return is_exec ? VT_EXEC : (is_write ? VT_WRITE : VT_READ);
 }
 
 // Log page fault
-void log_page_fault(struct proc *p, uint64 va, int is_write, int is_exec, const char* cause) {
-  const char* access = is_exec ? "exec" : (is_write ? "write" : "read");
-  printf("[pid %d] PAGEFAULT va=0x%lx access=%s cause=%s\n", 
-          p->pid, va, access, cause);
+void log_page_fault(struct proc *p, uint64 va, int is_write, int is_exec, int cause) {
+  vmlog(p, VT_PAGEFAULT, va, access_code(is_write, is_exec), cause);
 }
 
-// Log page allocation
-void log_page_alloc(struct proc *p, uint64 va, const char* type) {
-  printf("[pid %d] %s va=0x%lx\n", p->pid, type, va);
+// Log page allocation; event says how the page was filled
+void log_page_alloc(struct proc *p, uint64 va, int event) {
+  vmlog(p, event, va, 0, 0);
 }
 
 // Log resident page
 void log_resident_page(struct proc *p, uint64 va, int seq) {
-  printf("[pid %d] RESIDENT va=0x%lx seq=%d\n", p->pid, va, seq);
+  vmlog(p, VT_RESIDENT, va, seq, 0);
+}
+
+// The resident ring.
+//
+// p->resident[] holds p's demand-paged pages in the order they were
+// mapped: p->res_head is the oldest and the next free entry follows
+// the newest. Pages can leave the page table behind the ring's back
+// (sbrk shrinking, exec), so entries are checked against the page
+// table when they reach the head and dropped if stale.
+
+#define RING(p, i) (&(p)->resident[((p)->res_head + (i)) % MAX_RESIDENT_PAGES])
+
+// Is ring entry r still mapped in p's page table, and p's alone?
+// (Pages shared copy-on-write after fork belong to no ring.)
+static int resident_valid(struct proc *p, struct resident_page *r) {
+  pte_t *pte = walkleaf(p->pagetable, r->va, 0);
+  return pte && (*pte & PTE_V) && PTE2PA(*pte) == r->pa &&
+         krefcount((void*)r->pa) == 1;
+}
+
+// Append a newly mapped page to the tail of p's ring.
+// The caller must have made room (see alloc_fault_page).
+static void resident_add(struct proc *p, uint64 va, uint64 pa, int seq) {
+  if(p->num_resident >= MAX_RESIDENT_PAGES)
+    panic("resident_add");
+  struct resident_page *r = RING(p, p->num_resident);
+  r->va = va;
+  r->pa = pa;
+  r->seq = seq;
+  r->is_dirty = 0;
+  r->swap_slot = -1;
+  r->age = 0x80;  // just referenced
+  p->num_resident++;
+}
+
+// Drop the oldest entry of p's ring
+static void resident_pop(struct proc *p) {
+  p->res_head = (p->res_head + 1) % MAX_RESIDENT_PAGES;
+  p->num_resident--;
+}
+
+// Forget ring entries for pages in [start, end), which are
+// being unmapped (sbrk shrinking the heap).
+void resident_drop_range(struct proc *p, uint64 start, uint64 end) {
+  int n = 0;
+  for(int i = 0; i < p->num_resident; i++) {
+    struct resident_page *r = RING(p, i);
+    if(r->va >= start && r->va < end)
+      continue;
+    *RING(p, n++) = *r;
+  }
+  p->num_resident = n;
+}
+
+// Remove entry i of p's ring, keeping the others in order
+static void resident_remove(struct proc *p, int i) {
+  for(; i > 0; i--)
+    *RING(p, i) = *RING(p, i-1);
+  resident_pop(p);
+}
+
+// Drop stale entries from the head of p's ring
+static void resident_prune(struct proc *p) {
+  while(p->num_resident > 0 && !resident_valid(p, RING(p, 0)))
+    resident_pop(p);
+}
+
+// The accessed bit of p's page at va is about to be cleared: if
+// the page was read ahead, remember that it has been used, for
+// readahead_adapt().
+static void readahead_note(struct proc *p, uint64 va) {
+  struct readahead *ra = &p->ra;
+
+  if(va >= ra->va && va < ra->va + ra->n*PGSIZE)
+    ra->used |= 1 << ((va - ra->va) / PGSIZE);
+}
+
+// Test and clear the hardware accessed bit of a resident page.
+// p's stale TLB entries are flushed when it next returns to
+// user space, after which the hardware sets PTE_A again on use.
+static int resident_referenced(struct proc *p, struct resident_page *r) {
+  pte_t *pte = walk(p->pagetable, r->va, 0);
+  int referenced = (*pte & PTE_A) != 0;
+  if(referenced)
+    readahead_note(p, r->va);
+  *pte &= ~PTE_A;
+  return referenced;
 }
 
 // Get the sequence number of a page (for FIFO)
 int get_page_seq(struct proc *p, uint64 va) {
-  // For now, use a simple approximation based on address
-  // In a full implementation, this would look up the actual sequence
-  // Use virtual address as a simple proxy for allocation order
-  return (int)(va / PGSIZE);
-}
-
-// Find victim page for replacement (FIFO algorithm)
-uint64 find_victim_page(struct proc *p) {
-  uint64 victim_va = 0;
-  int min_seq = 999999;  // Start with a high number
-  
-  // Walk through the page table to find resident pages
-  pagetable_t pagetable = p->pagetable;
-  for(uint64 va = 0; va < p->sz; va += PGSIZE) {
-    pte_t *pte = walk(pagetable, va, 0);
-    if(pte && (*pte & PTE_V)) {
-      // This is a valid resident page
-      int seq = get_page_seq(p, va);
-      if(seq < min_seq) {
-        min_seq = seq;
-        victim_va = va;
-      }
+  for(int i = 0; i < p->num_resident; i++) {
+    if(RING(p, i)->va == va)
+      return RING(p, i)->seq;
+  }
+  return -1;
+}
+
+// Get the aging counter of a resident page
+int get_page_age(struct proc *p, uint64 va) {
+  for(int i = 0; i < p->num_resident; i++) {
+    if(RING(p, i)->va == va)
+      return RING(p, i)->age;
+  }
+  return 0;
+}
+
+// Page-replacement policies.
+//
+// Each policy picks a victim among p's resident pages and returns
+// its index in the ring (0 is the oldest), or -1 if there is none.
+
+// FIFO: the oldest page.
+static int fifo_pick(struct proc *p) {
+  resident_prune(p);
+  return p->num_resident > 0 ? 0 : -1;
+}
+
+// Clock (second chance): starting from the oldest page, a page
+// whose accessed bit is set has the bit cleared and goes round to
+// the tail; the first unreferenced page is the victim. After one
+// full lap every bit is clear, so this terminates.
+static int clock_pick(struct proc *p) {
+  for(;;) {
+    resident_prune(p);
+    if(p->num_resident == 0)
+      return -1;
+    struct resident_page r = *RING(p, 0);
+    if(!resident_referenced(p, &r))
+      return 0;
+    resident_pop(p);
+    *RING(p, p->num_resident) = r;
+    p->num_resident++;
+  }
+}
+
+// Aging: shift each page's accessed bit into the top of its 8-bit
+// age and evict the page with the lowest age; the oldest page wins
+// ties. Ages are sampled whenever p needs a victim. Stale entries
+// are squeezed out along the way.
+static int aging_pick(struct proc *p) {
+  int n = 0, victim = -1;
+  for(int i = 0; i < p->num_resident; i++) {
+    struct resident_page r = *RING(p, i);
+    if(!resident_valid(p, &r))
+      continue;
+    r.age = (r.age >> 1) | (resident_referenced(p, &r) ? 0x80 : 0);
+    *RING(p, n) = r;
+    if(victim < 0 || r.age < RING(p, victim)->age)
+      victim = n;
+    n++;
+  }
+  p->num_resident = n;
+  return victim;
+}
+
+// Global replacement.
+//
+// When kalloc() runs dry, the victim is chosen with the system-wide
+// policy among all user pages in the core map, and is taken from
+// whichever process maps it. A process's pages are off limits while
+// it runs on another CPU or is in the fault handler, which may hold
+// pointers into its page table. copyin()/copyout() and fork don't
+// give up the CPU while they hold a pointer to a user page. The
+// owner's p->lock keeps its page table in place meanwhile.
+// The one exception is the faulting process itself: it evicts its
+// own pages, or global replacement may pick one, only from within
+// alloc_fault_page(), and the handler takes no PTE pointer before
+// that but the faulting page's own, which is not a candidate:
+// not yet valid, or shared copy-on-write and so with no owner.
+//
+// These picks return an index into the core map, or -1. skip[]
+// is a bitmap of the frames already found unusable. The caller
+// holds coremap.picklock, so that kswapd and faulting harts don't
+// move the Clock hand or age pages at the same time; the hand
+// and the ages are updated under coremap.lock as well, which
+// frame_referenced() can't be called with.
+
+#define NSKIPWORD ((NCOREFRAME + 63) / 64)
+
+static void skip_set(uint64 *skip, int i) {
+  skip[i / 64] |= 1UL << (i % 64);
+}
+
+// May global replacement take q's pages? Caller holds q->lock.
+// p may evict its own (see above).
+static int frame_stealable(struct proc *q) {
+  if(q == myproc())
+    return 1;
+  return (q->state == RUNNABLE || q->state == SLEEPING) && !q->in_fault;
+}
+
+// Lock the owner of frame f and return the PTE that maps f,
+// after checking that the core map is still right about it.
+// Returns 0, with nothing locked, if f can't be taken now.
+static pte_t* frame_lock(struct frame *f, struct proc **qp) {
+  struct proc *q = f->owner;
+  pte_t *pte;
+
+  if(q == 0 || holding(&q->lock))
+    return 0;
+  acquire(&q->lock);
+  if(f->owner == q && (f->flags & FRAME_USER) && q->pagetable &&
+     frame_stealable(q) && (pte = walkleaf(q->pagetable, f->va, 0)) != 0 &&
+     (*pte & PTE_V) && PTE2PA(*pte) == frame2pa(f)) {
+    *qp = q;
+    return pte;
+  }
+  release(&q->lock);
+  return 0;
+}
+
+// Test and clear the accessed bit of the page in frame f.
+// Returns -1 if f can't be taken now.
+static int frame_referenced(struct frame *f) {
+  struct proc *q;
+  pte_t *pte = frame_lock(f, &q);
+
+  if(pte == 0)
+    return -1;
+  int referenced = (*pte & PTE_A) != 0;
+  if(referenced)
+    readahead_note(q, f->va);
+  *pte &= ~PTE_A;
+  release(&q->lock);
+  return referenced;
+}
+
+// Is frame f a user page not yet ruled out?
+static int frame_candidate(int i, uint64 *skip) {
+  return !(skip[i / 64] & (1UL << (i % 64))) && (coremap.frames[i].flags & FRAME_USER);
+}
+
+// FIFO: the page mapped longest ago.
+static int fifo_pick_frame(uint64 *skip) {
+  int victim = -1;
+
+  acquire(&coremap.lock);
+  for(int i = 0; i < NCOREFRAME; i++) {
+    if(!frame_candidate(i, skip))
+      continue;
+    if(victim < 0 || coremap.frames[i].seq < coremap.frames[victim].seq)
+      victim = i;
+  }
+  release(&coremap.lock);
+  return victim;
+}
+
+// Clock: sweep a hand round the core map, clearing accessed bits;
+// the first page found unreferenced is the victim.
+static int clock_pick_frame(uint64 *skip) {
+  for(int n = 0; n < 2*NCOREFRAME; n++) {
+    acquire(&coremap.lock);
+    int i = coremap.hand;
+    coremap.hand = (coremap.hand + 1) % NCOREFRAME;
+    release(&coremap.lock);
+    if(!frame_candidate(i, skip))
+      continue;
+    int referenced = frame_referenced(&coremap.frames[i]);
+    if(referenced < 0)
+      skip_set(skip, i);
+    else if(!referenced)
+      return i;
+  }
+  return -1;
+}
+
+// Aging: age every page and take the lowest age, oldest first.
+static int aging_pick_frame(uint64 *skip) {
+  int victim = -1;
+
+  for(int i = 0; i < NCOREFRAME; i++) {
+    if(!frame_candidate(i, skip))
+      continue;
+    struct frame *f = &coremap.frames[i];
+    int referenced = frame_referenced(f);
+    if(referenced < 0) {
+      skip_set(skip, i);
+      continue;
+    }
+    acquire(&coremap.lock);
+    f->age = (f->age >> 1) | (referenced ? 0x80 : 0);
+    if(victim < 0 || f->age < coremap.frames[victim].age ||
+       (f->age == coremap.frames[victim].age && f->seq < coremap.frames[victim].seq))
+      victim = i;
+    release(&coremap.lock);
+  }
+  return victim;
+}
+
+struct pgpolicy {
+  int (*pick)(struct proc*);   // among one process's resident pages
+  int (*pick_frame)(uint64*);  // among all pages in the core map
+};
+
+static struct pgpolicy policies[NPOLICY] = {
+[POLICY_FIFO]  { fifo_pick,  fifo_pick_frame },
+[POLICY_CLOCK] { clock_pick, clock_pick_frame },
+[POLICY_AGING] { aging_pick, aging_pick_frame },
+};
+
+// System-wide policy, for processes that have not chosen their own
+static int default_policy = POLICY_FIFO;
+
+// The policy in effect for p
+int proc_policy(struct proc *p) {
+  return p->policy == POLICY_DEFAULT ? default_policy : p->policy;
+}
+
+// Set the replacement policy of process pid, or the system-wide
+// policy if pid is 0. POLICY_DEFAULT puts a process back on the
+// system-wide policy. Returns 0, or -1 on a bad pid or policy.
+int ksetpolicy(int pid, int policy) {
+  struct proc *p;
+
+  if(pid == 0) {
+    if(policy < 0 || policy >= NPOLICY)
+      return -1;
+    default_policy = policy;
+    return 0;
+  }
+
+  if(policy < POLICY_DEFAULT || policy >= NPOLICY)
+    return -1;
+  for(p = proc; p < &proc[NPROC]; p++) {
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED) {
+      p->policy = policy;
+      release(&p->lock);
+      return 0;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
+// Set how many extra pages process pid maps around a text/data
+// fault. Returns 0, or -1 on a bad pid or count.
+int ksetfaultaround(int pid, int npages) {
+  struct proc *p;
+
+  if(npages < 0 || npages > MAXFAULTAROUND)
+    return -1;
+  for(p = proc; p < &proc[NPROC]; p++) {
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED) {
+      p->fault_around = npages;
+      release(&p->lock);
+      return 0;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
+// madvise() hints. RANDOM and SEQUENTIAL are kept for ranges of
+// p's address space, in p->advice[], and looked up at faults and
+// evictions; WILLNEED and DONTNEED act at once (see kmadvise()).
+
+// The advised range holding va, or 0
+static struct advice* advice_find(struct proc *p, uint64 va) {
+  for(struct advice *a = p->advice; a < &p->advice[MAX_ADVICE]; a++)
+    if(a->end && va >= a->start && va < a->end)
+      return a;
+  return 0;
+}
+
+// The advice in effect at va
+static int advice_at(struct proc *p, uint64 va) {
+  struct advice *a = advice_find(p, va);
+  return a ? a->advice : MADV_NORMAL;
+}
+
+static void advice_add(struct proc *p, uint64 start, uint64 end, int advice) {
+  for(struct advice *a = p->advice; a < &p->advice[MAX_ADVICE]; a++) {
+    if(a->end == 0) {
+      a->start = start;
+      a->end = end;
+      a->advice = advice;
+      return;
     }
   }
+  panic("advice_add");
+}
+
+// Make advice the advice for [start, end), cutting it out of
+// the ranges it overlaps. Returns -1, changing nothing, if p
+// would have more than MAX_ADVICE ranges.
+static int advice_set(struct proc *p, uint64 start, uint64 end, int advice) {
+  struct advice *a, *split = 0;
+  int nfree = 0;
+  
+  for(a = p->advice; a < &p->advice[MAX_ADVICE]; a++) {
+    if(a->end == 0 || (a->start >= start && a->end <= end))
+      nfree++;
+    else if(a->start < start && a->end > end)
+      split = a;
+  }
+  if(nfree < (split != 0) + (advice != MADV_NORMAL))
+    return -1;
+  
+  for(a = p->advice; a < &p->advice[MAX_ADVICE]; a++) {
+    if(a->end == 0 || a->end <= start || a->start >= end || a == split)
+      continue;
+    if(a->start < start)
+      a->end = start;
+    else if(a->end > end)
+      a->start = end;
+    else
+      a->end = 0;
+  }
+  if(split) {
+    advice_add(p, end, split->end, split->advice);
+    split->end = start;
+  }
+  if(advice != MADV_NORMAL)
+    advice_add(p, start, end, advice);
+  return 0;
+}
+
+// p's memory from va up is going away: so is its advice, lest
+// it apply to whatever is mapped there later.
+void advice_clip(struct proc *p, uint64 va) {
+  for(struct advice *a = p->advice; a < &p->advice[MAX_ADVICE]; a++) {
+    if(a->end <= va)
+      continue;
+    if(a->start < va)
+      a->end = va;
+    else
+      a->end = 0;
+  }
+}
+
+// Evict-behind: a process reading through a SEQUENTIAL range has
+// no more use for the pages it has passed. Returns the index in
+// p's ring of the one furthest behind va in va's range, or -1.
+static int behind_pick(struct proc *p, uint64 va) {
+  struct advice *a = advice_find(p, va);
+  int victim = -1;
   
-  return victim_va;
+  if(a == 0 || a->advice != MADV_SEQUENTIAL)
+    return -1;
+  for(int i = 0; i < p->num_resident; i++) {
+    struct resident_page *r = RING(p, i);
+    if(r->va >= a->start && r->va < va && resident_valid(p, r) &&
+       (victim < 0 || r->va < RING(p, victim)->va))
+      victim = i;
+  }
+  return victim;
+}
+
+// Find victim page for replacement with p's policy. Returns the
+// victim's index in p's ring, or -1 if p has no resident
+// demand-paged pages.
+int find_victim_page(struct proc *p) {
+  return policies[proc_policy(p)].pick(p);
+}
+
+// The file whose pages seg holds: the executable, or one mmap()ed
+static struct inode* segment_inode(struct proc *p, struct segment *seg) {
+  return seg->ip ? seg->ip : p->exec_inode;
 }
 
 // Load data from executable file for a page in a segment
 int load_segment_page(struct proc *p, uint64 va, char *mem, struct segment *seg) {
-  if(!p->exec_inode || !seg || !mem) {
+  if(!seg || !segment_inode(p, seg) || !mem) {
     return -1;
   }
   
@@ -124,8 +570,19 @@ int load_segment_page(struct proc *p, uint64 va, char *mem, struct segment *seg)
       bytes_to_read = PGSIZE;
     }
     
-    // Read from executable file
-    if(readi(p->exec_inode, 0, (uint64)mem, file_offset, bytes_to_read) != bytes_to_read) {
+    // Read from the file, straight into the page, with the inode
+    // locked against a write() or truncation meanwhile. A read
+    // needs no log transaction. The fault may come from a read()
+    // or write() of the same file copying to or from the mapping,
+    // in which case p holds the lock already.
+    struct inode *ip = segment_inode(p, seg);
+    int locked = holdingsleep(&ip->lock);
+    if(!locked)
+      ilock(ip);
+    int n = readi(ip, 0, (uint64)mem, file_offset, bytes_to_read);
+    if(!locked)
+      iunlock(ip);
+    if(n != bytes_to_read) {
       return -1;
     }
   }
@@ -134,273 +591,920 @@ int load_segment_page(struct proc *p, uint64 va, char *mem, struct segment *seg)
   return 0;
 }
 
-// Demand page fault handler with custom page table
-uint64 demand_page_fault_with_pagetable(struct proc *p, pagetable_t pagetable, uint64 va, int is_write, int is_exec) {
-  // Basic safety check
-  if(p == 0 || pagetable == 0) {
-    printf("[pid ?] DEBUG: demand_page_fault_with_pagetable called with null proc or pagetable\n");
+// mmap(): map len bytes of ip from off on, whose size is fsize,
+// above the end of p's memory. The mapping is a segment of its
+// own, faulted in page by page like the executable's, straight
+// from the file into the page (read-only ones shared through the
+// page cache). prot is PROT_*; the caller has checked that a
+// writable mapping is private. Returns the address, or -1.
+// A shared mapping is not kept coherent with write(): a page
+// already faulted in keeps what it read until it is evicted,
+// though pages faulted in later see the file as it is then.
+// write() only stops the page cache handing out old copies.
+uint64 kmmap(struct proc *p, struct inode *ip, uint off, uint fsize, int len, int prot) {
+  uint64 va = PGROUNDUP(p->sz);
+  uint64 end = va + PGROUNDUP((uint64)len);
+  
+  if(off % PGSIZE || len <= 0 || end > TRAPFRAME || p->num_segments >= MAX_SEGMENTS)
+    return -1;
+  struct segment *seg = &p->segments[p->num_segments++];
+  seg->va_start = va;
+  seg->va_end = end;
+  seg->file_offset = off;
+  seg->file_size = off >= fsize ? 0 : (fsize - off < len ? fsize - off : len);
+  seg->mem_size = end - va;
+  seg->flags = ((prot & PROT_EXEC) ? 0x1 : 0) | ((prot & PROT_WRITE) ? 0x2 : 0) |
+               ((prot & PROT_READ) ? 0x4 : 0);
+  seg->ip = idup(ip);
+  p->sz = end;
+  return va;
+}
+
+// Drop p's mapped files from va from on: those wholly above it
+// go, one it cuts is shortened. The caller is in a file-system
+// transaction, for iput().
+void mmap_release(struct proc *p, uint64 from) {
+  int n = 0;
+  
+  for(int i = 0; i < p->num_segments; i++) {
+    struct segment seg = p->segments[i];
+    if(seg.ip && seg.va_end > from) {
+      if(seg.va_start >= from) {
+        iput(seg.ip);
+        continue;
+      }
+      seg.va_end = seg.va_start + PGROUNDUP(from - seg.va_start);
+      seg.mem_size = seg.va_end - seg.va_start;
+      if(seg.file_size > seg.mem_size)
+        seg.file_size = seg.mem_size;
+    }
+    p->segments[n++] = seg;
+  }
+  p->num_segments = n;
+}
+
+// The part of the executable that the page at va of seg holds:
+// sets *off to its file offset and returns its length, as read
+// by load_segment_page().
+static uint segment_page_range(struct segment *seg, uint64 va, uint *off) {
+  uint64 seg_offset = va - seg->va_start;
+  
+  *off = seg->file_offset + seg_offset;
+  if(seg_offset >= seg->file_size)
     return 0;
+  uint64 n = seg->file_size - seg_offset;
+  return n > PGSIZE ? PGSIZE : n;
+}
+
+// Can the pages of seg go in the shared page cache? Only if no
+// process can write them.
+static int segment_cacheable(struct proc *p, struct segment *seg) {
+  return segment_inode(p, seg) && (seg->flags & 0x2) == 0;
+}
+
+// Map the page at va of seg from the page cache. Returns 0, or
+// -1 if the cache doesn't hold it.
+static int map_cached_page(struct proc *p, pagetable_t pagetable, uint64 va, struct segment *seg) {
+  uint off;
+  uint len = segment_page_range(seg, va, &off);
+  uint64 pa = pcache_get(segment_inode(p, seg), off, len);
+  
+  if(pa == 0)
+    return -1;
+  if(mappages(pagetable, va, PGSIZE, pa, PTE_U | flags2perm(seg->flags) | PTE_F) != 0) {
+    kfree((void*)pa);
+    return -1;
   }
+  return 0;
+}
+
+// Offer the page at va of seg, just read into pa, to the page
+// cache. Returns 1 if it is now shared through the cache.
+static int cache_page(struct proc *p, uint64 va, struct segment *seg, uint64 pa) {
+  uint off;
+  uint len = segment_page_range(seg, va, &off);
   
-  // printf("[pid %d] DEBUG: demand_page_fault_with_pagetable called va=0x%lx, write=%d, exec=%d\n", p->pid, va, is_write, is_exec);
-  // printf("[pid %d] DEBUG: heap_start=0x%lx, p->sz=0x%lx\n", p->pid, p->heap_start, p->sz);
+  return pcache_put(segment_inode(p, seg), off, len, pa);
+}
+
+// The slot that would put the page at va next to its neighbours
+// in swap, for swap_alloc_slot() to try first, or -1.
+static int near_slot(pagetable_t pagetable, uint64 va) {
+  pte_t *pte;
   
-  va = PGROUNDDOWN(va);
+  if(va >= PGSIZE && (pte = walkleaf(pagetable, va - PGSIZE, 0)) && (*pte & PTE_S))
+    return PTE2SLOT(*pte) + 1;
+  if(va + PGSIZE < MAXVA && (pte = walkleaf(pagetable, va + PGSIZE, 0)) && (*pte & PTE_S))
+    return PTE2SLOT(*pte) - 1;
+  return -1;
+}
+
+// A page being evicted, and the slot it is to be written to,
+// or -1 if it needn't be.
+struct victim {
+  char *pa;
+  struct proc *q;   // whose it was
+  uint64 va;
+  int slot;
+};
+
+// Take the page in frame f from its owner, leaving a swap entry in
+// the owner's PTE, and fill in v. A dirty page gets a slot next to
+// its neighbours in the owner's address space if it can, or else
+// slot near if that is free. Returns -1 if the page can't be taken.
+static int evict_unmap(struct frame *f, int seq, int policy, int near, struct victim *v) {
+  struct proc *q;
+  pte_t *pte = frame_lock(f, &q);
+  if(pte == 0)
+    return -1;
   
-  // Determine the cause and log it
-  const char* cause = get_fault_cause(p, va, is_write, is_exec);
-  log_page_fault(p, va, is_write, is_exec, cause);
+  // A megapage goes a page at a time: split it, and take its
+  // first page. The others have their own entries from now on.
+  if(f->flags & FRAME_MEGA)
+    pte = walk(q->pagetable, f->va, 0);
   
+  uint64 va = f->va;
+  uint64 pa = frame2pa(f);
+  int perm = *pte & (PTE_R|PTE_W|PTE_X|PTE_U);
+  int dirty = (*pte & PTE_D) != 0;
+  int slot = frame_take_slot(pa);
   
-  // Handle invalid accesses
-  if(strncmp(cause, "invalid", 7) == 0) {
-    const char* access = is_exec ? "exec" : (is_write ? "write" : "read");
-    printf("[pid %d] KILL invalid-access va=0x%lx access=%s\n", 
-            p->pid, va, access);
-    setkilled(p);  // Kill the process
+  vmlog(q, VT_VICTIM, va, seq, policy);
+  vmlog(q, VT_EVICT, va, dirty, 0);
+  v->pa = (char*)pa;
+  v->q = q;
+  v->va = va;
+  v->slot = -1;
+  
+  if(!dirty && slot >= 0) {
+    // Unchanged since it was read from swap: the copy there will do.
+    *pte = SLOT2PTE(slot) | perm | PTE_S;
+    frame_unmap(pa);
+    release(&q->lock);
+    vmlog(q, VT_SWAPOUT, va, slot, 1);
     return 0;
   }
   
-  // Check if page already exists
-  pte_t *pte = walk(pagetable, va, 0);
-  if(pte && (*pte & PTE_V)) {
-    // Page exists, might be permission issue
-    if(is_write && !(*pte & PTE_W)) {
-      // Handle write to clean page (dirty bit tracking)
-      *pte |= PTE_W;
-      log_page_alloc(p, va, "DIRTY");
-      return va;
+  if(!dirty) {
+    // Still what the fault handler put there, an executable page
+    // or a zero-filled one: drop it, and fault it in again later.
+    *pte = 0;
+    frame_unmap(pa);
+    release(&q->lock);
+    vmlog(q, VT_DISCARD, va, 0, 0);
+    return 0;
+  }
+  
+  if(slot >= 0)
+    swap_free_slot(slot);  // out of date
+  int want = near_slot(q->pagetable, va);
+  slot = swap_alloc_slot(want >= 0 ? want : near);
+  if(slot < 0) {
+    release(&q->lock);
+    vmlog(q, VT_SWAPFULL, 0, 0, 0);
+    return -1;
+  }
+  
+  // Replace the mapping with a swap entry, keeping the permissions
+  // so that the page comes back the way it left (but no longer
+  // as a copy of the executable). A fault on it waits in
+  // swap_in_pages() until the caller has written the page out.
+  *pte = SLOT2PTE(slot) | perm | PTE_S;
+  frame_unmap(pa);
+  release(&q->lock);
+  v->slot = slot;
+  return 0;
+}
+
+// Write out those of the n evicted pages in v[] that need it,
+// each run of consecutive slots in one request.
+static void evict_write(struct victim *v, int n) {
+  char *run[SWAPCLUSTER];
+  int i = 0, j, m;
+  
+  while(i < n) {
+    if(v[i].slot < 0) {
+      i++;
+      continue;
+    }
+    m = 0;
+    for(j = i; j < n; j++) {
+      if(v[j].slot < 0)
+        continue;
+      if(v[j].slot != v[i].slot + m)
+        break;
+      run[m++] = v[j].pa;
     }
-    return va; // Already mapped
+    swap_write_pages(run, m, v[i].slot);
+    for(; i < j; i++)
+      if(v[i].slot >= 0)
+        vmlog(v[i].q, VT_SWAPOUT, v[i].va, v[i].slot, 0);
   }
+}
+
+// Evict the page in frame f to swap. Returns the page, now the
+// caller's, or 0 if it can't be taken.
+static char* evict_frame(struct frame *f, int seq, int policy) {
+  struct victim v;
   
-  // Try to allocate physical page
-  char *mem = kalloc();
-  if(mem == 0) {
-    // No free memory - trigger page replacement
-    printf("[pid %d] MEMFULL\n", p->pid);
-    
-    // Find victim page using FIFO algorithm
-    uint64 victim_va = find_victim_page(p);
-    if(victim_va == 0) {
-      printf("[pid %d] KILL no-victim va=0x%lx\n", p->pid, va);
-      return 0;
+  if(evict_unmap(f, seq, policy, -1, &v) < 0)
+    return 0;
+  evict_write(&v, 1);
+  return v.pa;
+}
+
+// The frames of the megapages p maps whole, which count against
+// its resident-set limit like as many pages. Sets *fp to the first
+// frame of one of them, if there is one and fp isn't 0.
+static int mega_charge(struct proc *p, struct frame **fp) {
+  int n = 0;
+  
+  acquire(&coremap.lock);
+  for(int i = NFRAME; i < NCOREFRAME; i += MEGAFRAMES) {
+    struct frame *f = &coremap.frames[i];
+    if((f->flags & FRAME_MEGA) && f->owner == p) {
+      n += MEGAFRAMES;
+      if(fp)
+        *fp = f;
     }
-    
-    // Get victim page info
-    pte_t *victim_pte = walk(p->pagetable, victim_va, 0);
-    if(!victim_pte || !(*victim_pte & PTE_V)) {
-      printf("[pid %d] KILL invalid-victim va=0x%lx\n", p->pid, victim_va);
-      return 0;
+  }
+  release(&coremap.lock);
+  return n;
+}
+
+// How many pages p's ring may hold: its limit, less what its
+// megapages take of it. Negative if they alone are over it.
+static int ring_limit(struct proc *p) {
+  int n = p->rss_limit - mega_charge(p, 0);
+  return n < MAX_RESIDENT_PAGES ? n : MAX_RESIDENT_PAGES;
+}
+
+// Evict one of p's own resident pages, to make room for the one
+// at va: one va has left behind it, else one chosen by p's policy.
+// With none in its ring, a megapage of p's is split and its first
+// page taken; the rest are no longer charged to p's limit, and are
+// left to global replacement. Returns the freed physical page, or
+// 0 if there is none or it couldn't be written out.
+static char* evict_page(struct proc *p, uint64 va) {
+  struct frame *f;
+  int victim = behind_pick(p, va);
+  if(victim < 0)
+    victim = find_victim_page(p);
+  if(victim < 0 && mega_charge(p, &f) > 0)
+    return evict_frame(f, f->seq, proc_policy(p));
+  if(victim < 0)
+    return 0;
+  
+  struct resident_page *r = RING(p, victim);
+  char *mem = evict_frame(pa2frame(r->pa), r->seq, proc_policy(p));
+  if(mem == 0)
+    return 0;
+  resident_remove(p, victim);
+  return mem;
+}
+
+// Page-fault frequency: adjust p's resident-set limit at a fault
+// that needs a frame. A fault within PFF_INTERVAL of the last one
+// means p is using more than it holds, so the limit grows by a
+// page, unless memory is short. Each quiet interval since the last
+// fault takes a page off it instead.
+static void pff_update(struct proc *p) {
+  uint64 now = r_time();
+  uint64 quiet = (now - p->last_fault) / PFF_INTERVAL;
+  
+  p->last_fault = now;
+  if(quiet == 0) {
+    if(p->rss_limit < MAX_RSS_LIMIT && kfreepages() > PFF_MINFREE)
+      p->rss_limit++;
+  } else if(quiet >= p->rss_limit - MIN_RESIDENT_PAGES) {
+    p->rss_limit = MIN_RESIDENT_PAGES;
+  } else {
+    p->rss_limit -= quiet;
+  }
+}
+
+// A page that was shared, copy-on-write or through the page
+// cache, but has a single user again is FRAME_UNSHARED (see
+// kfree()). Find the process that maps it, by the address all the
+// sharers used, so that global replacement may take the page. If
+// none does, the page cache holds the last reference. The faulting
+// process's own pages are left for later: it may be in the middle
+// of copying one (cow_fault).
+static void frame_adopt_unshared(void) {
+  for(int i = 0; i < NCOREFRAME && coremap.nunshared > 0; i++) {
+    struct frame *f = &coremap.frames[i];
+    if(!(f->flags & FRAME_UNSHARED))
+      continue;
+    uint64 pa = frame2pa(f);
+    int busy = 0, found = 0;
+    for(struct proc *q = proc; q < &proc[NPROC] && !found; q++) {
+      if(q == myproc() || holding(&q->lock)) {
+        busy = 1;
+        continue;
+      }
+      acquire(&q->lock);
+      pte_t *pte = (q->state != UNUSED && q->pagetable) ? walkleaf(q->pagetable, f->va, 0) : 0;
+      if(pte && (*pte & PTE_V) && PTE2PA(*pte) == pa) {
+        frame_map(pa, q, f->va);
+        found = 1;
+      }
+      release(&q->lock);
     }
+    if(!found && !busy)
+      frame_disown(pa);
+  }
+}
+
+// Evict up to n of the coldest pages in the whole system, by the
+// system-wide policy, putting them in pages[]. The dirty ones go
+// to consecutive slots where they can, to be written together.
+// Returns how many were evicted.
+static int evict_global(char **pages, int n) {
+  int policy = default_policy;
+  uint64 skip[NSKIPWORD];
+  struct victim v[SWAPCLUSTER];
+  int i, k = 0, near = -1;
+  
+  frame_adopt_unshared();
+  memset(skip, 0, sizeof(skip));
+  while(k < n) {
+    acquire(&coremap.picklock);
+    i = policies[policy].pick_frame(skip);
+    release(&coremap.picklock);
+    if(i < 0)
+      break;
+    skip_set(skip, i);
+    if(evict_unmap(&coremap.frames[i], coremap.frames[i].seq, policy, near, &v[k]) < 0)
+      continue;
+    if(v[k].slot >= 0)
+      near = v[k].slot + 1;
+    k++;
+  }
+  evict_write(v, k);
+  for(i = 0; i < k; i++)
+    pages[i] = v[i].pa;
+  return k;
+}
+
+// Background reclaim. A fault that finds fewer than reclaim.low
+// free frames wakes kswapd, which evicts the system's coldest
+// pages until reclaim.high frames are free, so that faults
+// seldom have to wait for an eviction themselves. Both evict
+// reclaim.batch pages at a time, written out together.
+struct {
+  struct spinlock lock;
+  int low;          // free frames below which kswapd wakes
+  int high;         // free frames at which it stops
+  int batch;        // pages evicted in one pass
+  int active;       // kswapd is reclaiming
+  uint64 wakeups;   // times kswapd has been woken
+  uint64 pages;     // frames it has freed
+} reclaim;
+
+void kswapdinit(void) {
+  initlock(&reclaim.lock, "reclaim");
+  reclaim.low = FREELOW;
+  reclaim.high = FREEHIGH;
+  reclaim.batch = SWAPCLUSTER;
+}
+
+// Wake kswapd if free frames are below the low watermark.
+static void kswapd_wake(void) {
+  if(reclaim.active || kfreepages() >= reclaim.low)
+    return;
+  acquire(&reclaim.lock);
+  if(!reclaim.active) {
+    reclaim.active = 1;
+    reclaim.wakeups++;
+    wakeup(&reclaim);
+  }
+  release(&reclaim.lock);
+}
+
+// Kernel thread that keeps frames free.
+void kswapd(void) {
+  char *pages[SWAPCLUSTER];
+  int n;
+  
+  acquire(&reclaim.lock);
+  for(;;) {
+    reclaim.active = 0;
+    while(!reclaim.active)
+      sleep(&reclaim, &reclaim.lock);
+    release(&reclaim.lock);
     
-    uint64 victim_pa = PTE2PA(*victim_pte);
-    int victim_seq = get_page_seq(p, victim_va);
-    
-    printf("[pid %d] VICTIM va=0x%lx seq=%d algo=FIFO\n", p->pid, victim_va, victim_seq);
-    
-    // Check if page is dirty (has been written to)
-    const char* state = (*victim_pte & PTE_W) ? "dirty" : "clean";
-    printf("[pid %d] EVICT va=0x%lx state=%s\n", p->pid, victim_va, state);
-    
-    // Swap out the victim page
-    int swap_slot = swap_out_page(p, victim_va, victim_pa);
-    if(swap_slot < 0) {
-      printf("[pid %d] KILL swapout-failed va=0x%lx\n", p->pid, victim_va);
-      return 0;
+    pcache_shrink();  // cached text no one is using goes first
+    while(kfreepages() < reclaim.high && (n = evict_global(pages, reclaim.batch)) > 0) {
+      for(int i = 0; i < n; i++)
+        kfree(pages[i]);
+      __sync_fetch_and_add(&reclaim.pages, n);
     }
-    
-    // Unmap the victim page
-    uvmunmap(p->pagetable, victim_va, 1, 0);
-    
-    // Use the freed physical page
-    mem = (char*)victim_pa;
+    acquire(&reclaim.lock);
   }
+}
+
+// Set the watermarks: kswapd wakes below low free frames and
+// stops at high. Reclaim evicts batch pages at a time.
+int ksetwatermarks(int low, int high, int batch) {
+  if(low < 1 || high <= low || high > NFRAME / 2 || batch < 1 || batch > SWAPCLUSTER)
+    return -1;
+  acquire(&reclaim.lock);
+  reclaim.low = low;
+  reclaim.high = high;
+  reclaim.batch = batch;
+  release(&reclaim.lock);
+  return 0;
+}
+
+// Report the watermarks and what kswapd has done.
+void reclaim_stat(struct vmstat *st) {
+  st->free_low = reclaim.low;
+  st->free_high = reclaim.high;
+  st->evict_batch = reclaim.batch;
+  st->kswapd_wakeups = reclaim.wakeups;
+  st->kswapd_pages = reclaim.pages;
+}
+
+// Note what kind of fault p is serving, for the latency
+// histograms. One that had to evict a page is counted as such.
+static void fault_kind(struct proc *p, int type) {
+  if(p->fault_type != FT_EVICT)
+    p->fault_type = type;
+}
+
+// Allocate a physical page for a faulting va, evicting if memory
+// is full. If zero is set the page comes back filled with zeros.
+static char* alloc_fault_page(struct proc *p, uint64 va, int zero) {
+  char *mem = 0;
   
-  // Initialize page content and determine permissions based on cause
-  int perm = PTE_U | PTE_V;
+  pff_update(p);
+  kswapd_wake();
+  // Over the limit, as a quiet spell leaves p: give back one
+  // page more each fault until p is down to it.
+  if(p->num_resident > ring_limit(p) && (mem = evict_page(p, va)) != 0) {
+    kfree(mem);
+    mem = 0;
+  }
   
-  if(strncmp(cause, "text", 4) == 0 || strncmp(cause, "data", 4) == 0) {
-    // Load text/data page from executable
-    struct segment *seg = find_segment(p, va);
-    if(!seg || !p->exec_inode) {
-      kfree(mem);
-      printf("[pid %d] KILL no-segment va=0x%lx cause=%s\n", p->pid, va, cause);
+  // At its resident-set limit, p replaces one of its own pages
+  // instead of taking another frame. If global replacement
+  // already took them all, the ring is now empty and p may
+  // have a new frame.
+  if(p->num_resident >= ring_limit(p)) {
+    mem = evict_page(p, va);
+    if(mem == 0 && p->num_resident >= ring_limit(p)) {
+      vmlog(p, VT_KILL, va, VK_SWAPOUT, 0);
       return 0;
     }
-    
-    if(load_segment_page(p, va, mem, seg) < 0) {
-      kfree(mem);
-      printf("[pid %d] KILL load-failed va=0x%lx cause=%s\n", p->pid, va, cause);
-      return 0;
+    if(mem)
+      p->fault_type = FT_EVICT;
+  }
+  
+  if(mem == 0) {
+    // A free page; the pool kzerod keeps saves clearing it here
+    if((mem = zero ? kalloc_zeroed() : kalloc()) != 0)
+      return mem;
+    if(pcache_shrink() > 0)
+      mem = kalloc();  // cached text no one was using
+  }
+  if(mem == 0) {
+    // No free memory - take pages from whoever has the coldest:
+    // a batch, so that the next faults find the spares free
+    char *pages[SWAPCLUSTER];
+    int n;
+    vmlog(p, VT_MEMFULL, 0, 0, 0);
+    if((n = evict_global(pages, reclaim.batch)) > 0) {
+      mem = pages[0];
+      while(--n > 0)
+        kfree(pages[n]);
+      p->fault_type = FT_EVICT;
+    } else {
+      vmlog(p, VT_KILL, va, VK_NOVICTIM, 0);
     }
-    
-    // Set permissions based on segment flags
-    perm |= flags2perm(seg->flags);
-    log_page_alloc(p, va, "LOADEXEC");
-    
-  } else if(strncmp(cause, "heap", 4) == 0 || strncmp(cause, "stack", 5) == 0) {
-    // Zero-fill heap/stack pages
+  }
+  if(mem && zero)
     memset(mem, 0, PGSIZE);
-    perm |= PTE_R | PTE_W;
-    log_page_alloc(p, va, "ALLOC");
-    
-  } else {
-    // Invalid access
-    kfree(mem);
-    printf("[pid %d] KILL invalid-access va=0x%lx cause=%s\n", p->pid, va, cause);
-    return 0;
+  return mem;
+}
+
+// A zero-fill fault in a 2 MiB-aligned block that lies wholly in
+// p's heap and has nothing mapped yet: map the whole block with
+// one megapage, saving the other 511 faults. mem, the page already
+// allocated for the fault, is kept to split the megapage with if
+// part of it is ever unmapped. Returns -1, leaving mem to the
+// caller, if the block doesn't qualify or kzerod has no megapage
+// cleared. A megapage counts against p's resident-set limit as
+// MEGAFRAMES pages, so p gets one only once page-fault frequency
+// has raised its limit to hold it besides its ring, and only while
+// free frames are above kswapd's high watermark. It is in no ring:
+// global replacement, or p's own once it is over its limit, splits
+// it and takes its pages one at a time like any others.
+static int map_megapage(struct proc *p, pagetable_t pagetable, uint64 va, char *mem) {
+  uint64 base = MEGAROUNDDOWN(va);
+  char *pa;
+  
+  if(pagetable != p->pagetable || base < p->heap_start || base + MEGAPGSIZE > p->sz)
+    return -1;
+  if(p->num_resident + mega_charge(p, 0) + MEGAFRAMES > p->rss_limit || kfreepages() <= reclaim.high)
+    return -1;
+  for(int i = 0; i < p->num_segments; i++)
+    if(p->segments[i].va_start < base + MEGAPGSIZE && p->segments[i].va_end > base)
+      return -1;  // a mapped file shares the block
+  if((pa = kalloc_mega_zeroed()) == 0)
+    return -1;
+  if(mapmega(pagetable, base, (uint64)pa, PTE_R | PTE_W | PTE_U | PTE_A | PTE_D) != 0) {
+    kfree_mega(pa);
+    return -1;
+  }
+  kmega_setsplit(pa, mem);
+  frame_map_mega((uint64)pa, p, base);
+  vmlog(p, VT_MEGAPAGE, base, 0, 0);
+  fault_kind(p, FT_ZERO);
+  return 0;
+}
+
+// Record a page just mapped by the fault handler as resident;
+// returns its sequence number.
+static int track_resident(struct proc *p, pagetable_t pagetable, uint64 va, uint64 pa) {
+  int seq = p->next_seq++;
+  // Pages faulted into a page table that isn't p's yet are not
+  // tracked: whoever installs it enters them (frame_map_range()).
+  if(pagetable == p->pagetable) {
+    resident_add(p, va, pa, seq);
+    frame_map(pa, p, va);
   }
+  return seq;
+}
+
+// Record and log a page just mapped by the fault handler
+static void map_resident(struct proc *p, pagetable_t pagetable, uint64 va, uint64 pa) {
+  log_resident_page(p, va, track_resident(p, pagetable, va, pa));
+}
+
+// Fault-around: having loaded the text/data page at va, load up
+// to p->fault_around of the pages that follow it in seg as well,
+// saving a trap and a segment lookup for each (MAXFAULTAROUND in a
+// SEQUENTIAL range, none in a RANDOM one). The extra pages only
+// use free memory: nothing is evicted for them, and they stop at
+// p's resident-set limit.
+static void fault_around(struct proc *p, pagetable_t pagetable, uint64 va, struct segment *seg, int perm) {
+  int advice = advice_at(p, va);
+  int max = advice == MADV_SEQUENTIAL ? MAXFAULTAROUND :
+            advice == MADV_RANDOM ? 0 : p->fault_around;
+  int n = 0;
   
-  // Map the page
-  // Map the page to the specified page table
-  if(mappages(pagetable, va, PGSIZE, (uint64)mem, perm) != 0) {
-    kfree(mem);
-    printf("[pid %d] KILL mapping-failed va=0x%lx\n", p->pid, va);
-    return 0;
+  for(uint64 a = va + PGSIZE; a < seg->va_end && n < max; a += PGSIZE) {
+    pte_t *pte = walk(pagetable, a, 0);
+    if(pte && (*pte & (PTE_V|PTE_S)))
+      break;  // already there, or in swap
+    if(segment_cacheable(p, seg) && map_cached_page(p, pagetable, a, seg) == 0) {
+      n++;
+      continue;
+    }
+    if(pagetable == p->pagetable && p->num_resident >= ring_limit(p))
+      break;
+    char *mem = kalloc();
+    if(mem == 0)
+      break;
+    if(load_segment_page(p, a, mem, seg) < 0 ||
+       mappages(pagetable, a, PGSIZE, (uint64)mem, perm) != 0) {
+      kfree(mem);
+      break;
+    }
+    if(!segment_cacheable(p, seg) || !cache_page(p, a, seg, (uint64)mem))
+      track_resident(p, pagetable, a, (uint64)mem);
+    n++;
+  }
+  if(n > 0)
+    vmlog(p, VT_FAULTAROUND, va + PGSIZE, n, 0);
+}
+
+// Enter p's user pages in [start, end) into the core map. For
+// pages mapped outside the fault handler: fork, sbrk and exec.
+void frame_map_range(struct proc *p, uint64 start, uint64 end) {
+  for(uint64 va = PGROUNDUP(start); va < end; va += PGSIZE) {
+    int mega;
+    pte_t *pte = walkleaf(p->pagetable, va, &mega);
+    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0)
+      continue;
+    if(mega) {
+      frame_map_mega(PTE2PA(*pte), p, MEGAROUNDDOWN(va));
+      va = MEGAROUNDDOWN(va) + MEGAPGSIZE - PGSIZE;
+    } else {
+      frame_map(PTE2PA(*pte), p, va);
+    }
   }
+}
+
+// Copy-on-write: p stored to a page it has shared since fork.
+// Give p a copy of its own, unless the others have all gone.
+static int cow_fault(struct proc *p, pagetable_t pagetable, pte_t *pte, uint64 va) {
+  uint64 pa = PTE2PA(*pte);
   
-  // Log as resident (simplified - no actual resident tracking for now)
-  log_resident_page(p, va, p->next_seq++);
+  if(krefcount((void*)pa) == 1) {
+    *pte |= PTE_W | PTE_A | PTE_D;
+    if(pagetable == p->pagetable)
+      frame_map(pa, p, va);
+    log_page_alloc(p, va, VT_COWREUSE);
+    return 0;
+  }
   
+  // p's mapping holds a reference, so pa stays put even if
+  // alloc_fault_page() has to sleep.
+  char *mem = alloc_fault_page(p, va, 0);
+  if(mem == 0)
+    return -1;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | PTE_FLAGS(*pte) | PTE_W | PTE_A | PTE_D;
+  kfree((void*)pa);
+  log_page_alloc(p, va, VT_COW);
+  map_resident(p, pagetable, va, (uint64)mem);
+  return 0;
+}
+
+// Swap-in readahead. A fault on a swapped page also reads in the
+// pages after it whose slots follow its slot, up to p->ra.window
+// pages in all, in the same disk request. They are mapped without
+// the accessed bit, so that at p's next swap-in fault those it has
+// used since can be told from those it hasn't; page replacement
+// clears the bit as it samples it, so it first notes any it finds
+// set in p->ra.used. A window whose pages
+// were all used doubles; one mostly wasted halves. A process with
+// no readahead that faults on consecutive pages gets some again.
+static void readahead_adapt(struct proc *p, uint64 va) {
+  struct readahead *ra = &p->ra;
+  int hits = 0;
   
-  return va;
+  for(int i = 0; i < ra->n; i++) {
+    pte_t *pte = walkleaf(p->pagetable, ra->va + i*PGSIZE, 0);
+    if((ra->used & (1 << i)) || (pte && (*pte & PTE_V) && (*pte & PTE_A)))
+      hits++;
+  }
+  ra->hits += hits;
+  ra->misses += ra->n - hits;
+  if(ra->n > 0 && hits == ra->n)
+    ra->window = ra->window*2 < SWAPCLUSTER ? ra->window*2 : SWAPCLUSTER;
+  else if(ra->n > 0 && hits < ra->n - hits)
+    ra->window = ra->window > 1 ? ra->window/2 : 1;
+  else if(ra->window == 1 && va == ra->next)
+    ra->window = 2;
+  ra->n = 0;
+  ra->used = 0;
+  ra->next = va + PGSIZE;
 }
 
-// Demand page fault handler
-uint64 demand_page_fault(struct proc *p, uint64 va, int is_write, int is_exec) {
-  // Debug: demand page fault called
-  if(p == 0 || p->pagetable == 0) {
-    printf("[pid ?] DEBUG: demand_page_fault called with null proc or pagetable\n");
-    return 0;
+// Bring a swapped-out page back in, using the slot recorded in its PTE
+static int swap_in_fault(struct proc *p, pagetable_t pagetable, pte_t *pte, uint64 va) {
+  int slot = PTE2SLOT(*pte);
+  int perm = *pte & (PTE_R|PTE_W|PTE_X|PTE_U);
+  char *pages[SWAPCLUSTER];
+  pte_t *ptes[SWAPCLUSTER];
+  int n = 1;
+  
+  fault_kind(p, FT_SWAPIN);
+  char *mem = alloc_fault_page(p, va, 0);
+  if(mem == 0)
+    return -1;
+  pages[0] = mem;
+  
+  // Neighbours to read ahead, while p is under its limit
+  // and free frames are above kswapd's low watermark: as many
+  // as allowed in a SEQUENTIAL range, none in a RANDOM one.
+  if(pagetable == p->pagetable) {
+    readahead_adapt(p, va);
+    int advice = advice_at(p, va);
+    int window = advice == MADV_SEQUENTIAL ? SWAPCLUSTER :
+                 advice == MADV_RANDOM ? 1 : p->ra.window;
+    while(n < window && va + n*PGSIZE < MAXVA &&
+          p->num_resident + n < ring_limit(p) && kfreepages() > reclaim.low) {
+      pte_t *npte = walkleaf(pagetable, va + n*PGSIZE, 0);
+      if(npte == 0 || (*npte & PTE_S) == 0 || PTE2SLOT(*npte) != slot + n)
+        break;
+      if((pages[n] = kalloc()) == 0)
+        break;
+      ptes[n++] = npte;
+    }
+  }
+  
+  if(swap_in_pages(p, va, pages, n, slot) < 0) {
+    for(int i = 0; i < n; i++)
+      kfree(pages[i]);
+    vmlog(p, VT_KILL, va, VK_SWAPIN, slot);
+    return -1;
   }
   
-  // printf("[pid %d] DEBUG: demand_page_fault called va=0x%lx, write=%d, exec=%d\n", p->pid, va, is_write, is_exec);
-  // printf("[pid %d] DEBUG: heap_start=0x%lx, p->sz=0x%lx\n", p->pid, p->heap_start, p->sz);
+  // Mapped clean, so it can go back without being written out
+  // again unless it is modified meanwhile.
+  *pte = PA2PTE(mem) | perm | PTE_V;
+  map_resident(p, pagetable, va, (uint64)mem);
+  if(pagetable == p->pagetable)
+    frame_set_slot((uint64)mem, slot);
+  else
+    swap_free_slot(slot);
   
-  uint64 original_va = va;
+  for(int i = 1; i < n; i++) {
+    int nperm = *ptes[i] & (PTE_R|PTE_W|PTE_X|PTE_U);
+    *ptes[i] = PA2PTE(pages[i]) | nperm | PTE_V;
+    track_resident(p, pagetable, va + i*PGSIZE, (uint64)pages[i]);
+    frame_set_slot((uint64)pages[i], slot + i);
+  }
+  if(n > 1) {
+    p->ra.va = va + PGSIZE;
+    p->ra.n = n - 1;
+    p->ra.used = 0;
+    vmlog(p, VT_READAHEAD, va + PGSIZE, n - 1, 0);
+  }
+  return 0;
+}
+
+// Handle a fault on va in pagetable, on behalf of p.
+// Returns 0 on success, -1 if the process should not continue.
+static int handle_page_fault(struct proc *p, pagetable_t pagetable, uint64 va, int is_write, int is_exec) {
   va = PGROUNDDOWN(va);
+  p->num_faults++;
+  
+  // A swapped-out page: the PTE says where it went
+  pte_t *pte = (va < MAXVA) ? walkleaf(pagetable, va, 0) : 0;
+  if(pte && (*pte & PTE_S)) {
+    log_page_fault(p, va, is_write, is_exec, VT_SWAP);
+    return swap_in_fault(p, pagetable, pte, va);
+  }
   
   // Determine the cause and log it
-  const char* cause = get_fault_cause(p, va, is_write, is_exec);
+  int cause = fault_cause(p, va, is_exec);
   log_page_fault(p, va, is_write, is_exec, cause);
   
   // Handle invalid accesses
-  if(strncmp(cause, "invalid", 7) == 0) {
-    const char* access = is_exec ? "exec" : (is_write ? "write" : "read");
-    printf("[pid %d] KILL invalid-access va=0x%lx access=%s\n", 
-            p->pid, va, access);
+  if(cause == VT_INVALID) {
+    vmlog(p, VT_KILL, va, VK_ACCESS, access_code(is_write, is_exec));
     setkilled(p);  // Kill the process
-    return 0;
+    return -1;
+  }
+  
+  // The stack's guard page, or another the user may not touch
+  if(pte && (*pte & PTE_V) && !(*pte & PTE_U)) {
+    vmlog(p, VT_KILL, va, VK_ACCESS, access_code(is_write, is_exec));
+    setkilled(p);
+    return -1;
   }
   
   // Check if page already exists
-  pte_t *pte = walk(p->pagetable, va, 0);
   if(pte && (*pte & PTE_V)) {
-    // Page exists, might be permission issue
-    printf("[pid %d] DEBUG: Found existing page at va=0x%lx, pte=0x%lx\n", p->pid, va, *pte);
-    if(is_exec && !(*pte & PTE_X)) {
-      printf("[pid %d] DEBUG: Page exists but no execute permission, pte=0x%lx\n", p->pid, *pte);
-    }
-    if(is_write && !(*pte & PTE_W)) {
-      // Handle write to clean page (dirty bit tracking)
-      *pte |= PTE_W;
-      log_page_alloc(p, va, "DIRTY");
-      return original_va;
-    }
-    return original_va; // Already mapped
-  } else {
-    // No existing page found
+    // Page exists: a store to a page shared copy-on-write,
+    // or to one not yet marked dirty
+    if(is_write && !(*pte & PTE_W) && may_write(p, va))
+      return cow_fault(p, pagetable, pte, va);
+    if(is_write)
+      return handle_write_fault(p, pte, va);
+    return 0; // Already mapped
   }
   
-  // Try to allocate physical page
-  char *mem = kalloc();
-  if(mem == 0) {
-    // No free memory - trigger page replacement
-    printf("[pid %d] MEMFULL\n", p->pid);
-    
-    // Find victim page using FIFO algorithm
-    uint64 victim_va = find_victim_page(p);
-    if(victim_va == 0) {
-      printf("[pid %d] KILL no-victim va=0x%lx\n", p->pid, va);
-      return 0;
-    }
-    
-    // Get victim page info
-    pte_t *victim_pte = walk(p->pagetable, victim_va, 0);
-    if(!victim_pte || !(*victim_pte & PTE_V)) {
-      printf("[pid %d] KILL invalid-victim va=0x%lx\n", p->pid, victim_va);
-      return 0;
-    }
-    
-    uint64 victim_pa = PTE2PA(*victim_pte);
-    int victim_seq = get_page_seq(p, victim_va);
-    
-    printf("[pid %d] VICTIM va=0x%lx seq=%d algo=FIFO\n", p->pid, victim_va, victim_seq);
-    
-    // Check if page is dirty (has been written to)
-    const char* state = (*victim_pte & PTE_W) ? "dirty" : "clean";
-    printf("[pid %d] EVICT va=0x%lx state=%s\n", p->pid, victim_va, state);
-    
-    // Swap out the victim page
-    int swap_slot = swap_out_page(p, victim_va, victim_pa);
-    if(swap_slot < 0) {
-      printf("[pid %d] KILL swapout-failed va=0x%lx\n", p->pid, victim_va);
-      return 0;
-    }
-    
-    // Unmap the victim page
-    uvmunmap(p->pagetable, victim_va, 1, 0);
-    
-    // Use the freed physical page
-    mem = (char*)victim_pa;
+  // Text, or a read-only mapped file, that some process has
+  // read in already: share its copy
+  struct segment *seg = find_segment(p, va);
+  int mapped = cause == VT_MMAP;
+  if((cause == VT_TEXT || mapped) && seg && segment_cacheable(p, seg) &&
+     map_cached_page(p, pagetable, va, seg) == 0) {
+    log_page_alloc(p, va, VT_LOADCACHED);
+    log_resident_page(p, va, p->next_seq++);
+    fault_around(p, pagetable, va, seg, PTE_U | flags2perm(seg->flags) | PTE_F);
+    return 0;
   }
   
+  // Try to allocate physical page; heap and stack pages start zeroed
+  int anon = cause == VT_HEAP || cause == VT_STACK;
+  char *mem = alloc_fault_page(p, va, anon);
+  if(mem == 0)
+    return -1;
+  if(anon && map_megapage(p, pagetable, va, mem) == 0)
+    return 0;
+  
   // Initialize page content and determine permissions based on cause
   int perm = PTE_U | PTE_V;
   
-  if(strncmp(cause, "text", 4) == 0 || strncmp(cause, "data", 4) == 0) {
-    // Load text/data page from executable
-    struct segment *seg = find_segment(p, va);
-    if(!seg || !p->exec_inode) {
+  if(cause == VT_TEXT || cause == VT_DATA || mapped) {
+    // Load text/data page from executable, or a page of a mapped file
+    if(!seg || !segment_inode(p, seg)) {
       kfree(mem);
-      printf("[pid %d] KILL no-segment va=0x%lx cause=%s\n", p->pid, va, cause);
-      return 0;
+      vmlog(p, VT_KILL, va, VK_NOSEGMENT, cause);
+      return -1;
     }
     
     if(load_segment_page(p, va, mem, seg) < 0) {
       kfree(mem);
-      printf("[pid %d] KILL load-failed va=0x%lx cause=%s\n", p->pid, va, cause);
-      return 0;
+      vmlog(p, VT_KILL, va, VK_LOADFAIL, cause);
+      return -1;
     }
     
-    // Set permissions based on segment flags
-    perm |= flags2perm(seg->flags);
-    log_page_alloc(p, va, "LOADEXEC");
+    // Set permissions based on segment flags. Until it is written,
+    // the page can be dropped and read in again (see evict_frame).
+    perm |= flags2perm(seg->flags) | PTE_F;
+    log_page_alloc(p, va, VT_LOADEXEC);
+    fault_kind(p, FT_EXEC);
     
-  } else if(strncmp(cause, "heap", 4) == 0 || strncmp(cause, "stack", 5) == 0) {
-    // Zero-fill heap/stack pages
-    memset(mem, 0, PGSIZE);
+  } else if(anon) {
+    // Heap/stack pages: already zero-filled
     perm |= PTE_R | PTE_W;
-    log_page_alloc(p, va, "ALLOC");
+    log_page_alloc(p, va, VT_ALLOC);
+    fault_kind(p, FT_ZERO);
     
   } else {
     // Invalid access
     kfree(mem);
-    printf("[pid %d] KILL invalid-access va=0x%lx cause=%s\n", p->pid, va, cause);
-    return 0;
+    vmlog(p, VT_KILL, va, VK_BADCAUSE, cause);
+    return -1;
   }
   
-  // Map the page
-  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm) != 0) {
+  // Map the page to the specified page table
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, perm) != 0) {
     kfree(mem);
-    printf("[pid %d] KILL mapping-failed va=0x%lx\n", p->pid, va);
+    vmlog(p, VT_KILL, va, VK_MAPFAIL, 0);
+    return -1;
+  }
+  
+  // A text page in the page cache is shared, and in no ring
+  if((perm & PTE_F) && segment_cacheable(p, seg) && cache_page(p, va, seg, (uint64)mem))
+    log_resident_page(p, va, p->next_seq++);
+  else
+    map_resident(p, pagetable, va, (uint64)mem);
+  if(perm & PTE_F)
+    fault_around(p, pagetable, va, seg, perm);
+  
+  return 0;
+}
+
+// Demand page fault handler with custom page table
+// (one that is being built, before it becomes p->pagetable).
+uint64 demand_page_fault_with_pagetable(struct proc *p, pagetable_t pagetable, uint64 va, int is_write, int is_exec) {
+  // Basic safety check
+  if(p == 0 || pagetable == 0) {
+    printf("[pid ?] DEBUG: demand_page_fault_with_pagetable called with null proc or pagetable\n");
     return 0;
   }
   
-  // Log as resident (simplified - no actual resident tracking for now)
-  log_resident_page(p, va, p->next_seq++);
+  // keep global replacement away from p's pages meanwhile
+  p->in_fault = 1;
+  p->fault_type = FT_OTHER;
+  uint64 start = r_time();
+  int r = handle_page_fault(p, pagetable, va, is_write, is_exec);
+  vmlatency(p->fault_type, r_time() - start);
+  p->in_fault = 0;
+  if(r < 0)
+    return 0;
   
   // Demand page fault handled successfully
-  return original_va;
+  return va;
+}
+
+// Demand page fault handler
+uint64 demand_page_fault(struct proc *p, uint64 va, int is_write, int is_exec) {
+  if(p == 0 || p->pagetable == 0) {
+    printf("[pid ?] DEBUG: demand_page_fault called with null proc or pagetable\n");
+    return 0;
+  }
+  
+  return demand_page_fault_with_pagetable(p, p->pagetable, va, is_write, is_exec);
+}
+
+// madvise(): advice for how p will use [addr, addr+len).
+// RANDOM, SEQUENTIAL and NORMAL are recorded for the fault
+// handler. WILLNEED faults in what isn't there, stopping at p's
+// resident-set limit, so as not to push out what p has already.
+// DONTNEED unmaps the pages, freeing their frames and swap slots;
+// they come back at the next touch as a fresh page fault would
+// make them. Returns 0, or -1 on a bad range or advice.
+int kmadvise(struct proc *p, uint64 addr, int len, int advice) {
+  uint64 end = PGROUNDUP(addr + len);
+  
+  if(addr % PGSIZE || len <= 0 || end > PGROUNDUP(p->sz) || end <= addr)
+    return -1;
+  switch(advice) {
+  case MADV_NORMAL:
+  case MADV_RANDOM:
+  case MADV_SEQUENTIAL:
+    return advice_set(p, addr, end, advice);
+  case MADV_WILLNEED:
+    for(uint64 va = addr; va < end; va += PGSIZE) {
+      pte_t *pte = walkleaf(p->pagetable, va, 0);
+      if(pte && (*pte & PTE_V))
+        continue;
+      if(p->num_resident >= ring_limit(p))
+        break;
+      if(!(pte && (*pte & PTE_S)) &&
+         fault_cause(p, va, 0) == VT_INVALID)
+        continue;  // a hole: nothing to fault in
+      p->in_fault = 1;
+      p->fault_type = FT_OTHER;
+      int r = handle_page_fault(p, p->pagetable, va, 0, 0);
+      p->in_fault = 0;
+      if(r < 0)
+        return -1;
+    }
+    return 0;
+  case MADV_DONTNEED:
+    uvmunmap(p->pagetable, addr, (end - addr) / PGSIZE, 1);
+    resident_drop_range(p, addr, end);
+    return 0;
+  }
+  return -1;
 }
@@ -5,12 +5,53 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "vmtrace.h"
 
-// Simplified dirty page tracking - minimal stubs
+// Dirty page tracking.
+//
+// A resident page is dirty when it differs from the copy it can be
+// brought back from: its swap slot, its executable page, or a zero
+// fill. The fault handler maps pages with PTE_D clear and the
+// hardware sets PTE_D on the first store. Hardware that traps
+// instead (Svade) ends up in handle_write_fault(), which sets the
+// bit itself. The kernel's own stores through copyout() set it
+// directly. Eviction writes out only dirty pages.
+
+// Mark p's page at va dirty; returns -1 if it isn't resident
 int mark_page_dirty(struct proc *p, uint64 va) {
-  return 0; // Stub implementation
+  pte_t *pte = walkleaf(p->pagetable, PGROUNDDOWN(va), 0);
+  if(pte == 0 || (*pte & PTE_V) == 0)
+    return -1;
+  *pte |= PTE_D;
+  return 0;
+}
+
+// Has the resident page at va been modified?
+int page_is_dirty(pagetable_t pagetable, uint64 va) {
+  pte_t *pte = walkleaf(pagetable, va, 0);
+  return pte && (*pte & PTE_V) && (*pte & PTE_D);
+}
+
+// May p store to its page at va? Everything but
+// read-only executable segments is writable.
+int may_write(struct proc *p, uint64 va) {
+  struct segment *seg = find_segment(p, va);
+  if(seg)
+    return (seg->flags & 0x2) != 0;
+  return va < p->sz;
 }
 
-int handle_write_fault(struct proc *p, uint64 va) {
-  return 0; // Let normal page fault handler take care of it
+// A store to a resident page trapped. Mark the page dirty and let
+// the store go ahead. (Pages shared copy-on-write are dealt with
+// before this.) A store to read-only text kills the process.
+// Returns 0, or -1 if p should not continue.
+int handle_write_fault(struct proc *p, pte_t *pte, uint64 va) {
+  if((*pte & PTE_W) == 0) {
+    vmlog(p, VT_KILL, va, VK_ACCESS, VT_WRITE);
+    setkilled(p);
+    return -1;
+  }
+  *pte |= PTE_A | PTE_D;
+  log_page_alloc(p, va, VT_DIRTY);
+  return 0;
 }
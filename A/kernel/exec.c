@@ -30,8 +30,9 @@ kexec(char *path, char **argv)
   int i, off;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
-  struct inode *ip;
+  struct inode *ip, *execip = 0;
   struct proghdr ph;
+  struct segment segs[MAX_SEGMENTS];
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
@@ -55,7 +56,9 @@ kexec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // True demand paging - only record segment boundaries, no eager loading
+  // True demand paging - only record segment boundaries, no eager loading.
+  // The new image's paging state is kept here until exec commits:
+  // if it fails, p goes on with its old segments and mapped files.
   int num_segments = 0;
   
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
@@ -72,12 +75,13 @@ kexec(char *path, char **argv)
       
     // Store segment info for demand paging (no allocation yet)
     if(num_segments < MAX_SEGMENTS) {
-      p->segments[num_segments].va_start = ph.vaddr;
-      p->segments[num_segments].va_end = ph.vaddr + ph.memsz;
-      p->segments[num_segments].file_offset = ph.off;
-      p->segments[num_segments].file_size = ph.filesz;
-      p->segments[num_segments].mem_size = ph.memsz;
-      p->segments[num_segments].flags = ph.flags;
+      segs[num_segments].va_start = ph.vaddr;
+      segs[num_segments].va_end = ph.vaddr + ph.memsz;
+      segs[num_segments].file_offset = ph.off;
+      segs[num_segments].file_size = ph.filesz;
+      segs[num_segments].mem_size = ph.memsz;
+      segs[num_segments].flags = ph.flags;
+      segs[num_segments].ip = 0;
       num_segments++;
     }
     
@@ -86,60 +90,53 @@ kexec(char *path, char **argv)
       sz = ph.vaddr + ph.memsz;
   }
   
-  p->num_segments = num_segments;
-  // Initialize demand paging fields
-  p = myproc();
-  p->num_resident = 0;
-  p->next_seq = 0;
-  p->num_swapped = 0;
-  p->swap_file = 0;
-  p->exec_inode = ip; // Keep reference to executable for loading
-  idup(ip); // Increment reference count
-  p->heap_start = PGROUNDUP(sz);
+  uint64 heap_start = PGROUNDUP(sz);
   
   // Log the truly lazy mapping setup
   uint64 stack_top = TRAPFRAME;
   uint64 text_start = 0, text_end = 0, data_start = 0, data_end = 0;
-  for(int i = 0; i < p->num_segments; i++) {
-    if(p->segments[i].flags & 0x1) { // Executable
+  for(int i = 0; i < num_segments; i++) {
+    if(segs[i].flags & 0x1) { // Executable
       if(text_start == 0) {
-        text_start = p->segments[i].va_start;
-        text_end = p->segments[i].va_end;
+        text_start = segs[i].va_start;
+        text_end = segs[i].va_end;
       } else {
-        text_end = p->segments[i].va_end;
+        text_end = segs[i].va_end;
       }
     } else { // Data
       if(data_start == 0) {
-        data_start = p->segments[i].va_start;
-        data_end = p->segments[i].va_end;
+        data_start = segs[i].va_start;
+        data_end = segs[i].va_end;
       } else {
-        data_end = p->segments[i].va_end;
+        data_end = segs[i].va_end;
       }
     }
   }
-  printf("[pid %d] INIT-LAZYMAP text=[0x%lx,0x%lx) data=[0x%lx,0x%lx) heap_start=0x%lx stack_top=0x%lx\n",
-          p->pid, text_start, text_end, data_start, data_end, p->heap_start, stack_top);
+  if(vmverbose)
+    printf("[pid %d] INIT-LAZYMAP text=[0x%lx,0x%lx) data=[0x%lx,0x%lx) heap_start=0x%lx stack_top=0x%lx\n",
+           p->pid, text_start, text_end, data_start, data_end, heap_start, stack_top);
   
   // printf("[pid %d] DEBUG: exec setup complete, starting argument copy\n", p->pid);
   
-  iunlockput(ip);
+  // Keep the reference for loading pages from the executable
+  iunlock(ip);
   end_op();
+  execip = ip;
   ip = 0;
 
   uint64 oldsz = p->sz;
   
-  // Truly lazy - don't allocate any pages, just set size
+  // Text and data are left to the fault handler, but the stack
+  // is allocated now, as the arguments are about to be copied
+  // into it: a fault on the new image would be served with p's
+  // old segments, which stay in place until exec commits.
+  // Its lowest page is an inaccessible guard page.
   sz = PGROUNDUP(sz);
-  uint64 arg_start = sz;
-  
-  // Minimal pre-allocation for arguments (1 page for basic exec to work)
   uint64 sz1;
-  if((sz1 = uvmalloc(pagetable, sz, sz + PGSIZE, PTE_U | PTE_W | PTE_R)) == 0)
+  if((sz1 = uvmalloc(pagetable, sz, sz + (USERSTACK+1)*PGSIZE, PTE_U | PTE_W | PTE_R)) == 0)
     goto bad;
-  sz = arg_start + (USERSTACK+1)*PGSIZE; // Full stack size
-  
-  // Set process size early for demand paging to work during argument copying
-  p->sz = sz;
+  sz = sz1; // Full stack size
+  uvmclear(pagetable, sz-(USERSTACK+1)*PGSIZE);
   
   // Set up stack pointers
   sp = sz;
@@ -184,13 +181,33 @@ kexec(char *path, char **argv)
       last = s+1;
   safestrcpy(p->name, last, sizeof(p->name));
     
-  // Commit to the user image.
+  // Commit to the user image. Global replacement walks
+  // p->pagetable under p->lock.
+  acquire(&p->lock);
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
+  release(&p->lock);
   p->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
+  p->res_head = 0;       // the old image's pages are going away
+  p->num_resident = 0;
   proc_freepagetable(oldpagetable, oldsz);
+  frame_map_range(p, 0, sz);
+  
+  // The old image's mapped files and executable go, and the
+  // new image's paging state takes their place.
+  begin_op();
+  mmap_release(p, 0);
+  if(p->exec_inode)
+    iput(p->exec_inode);
+  end_op();
+  memmove(p->segments, segs, sizeof(segs));
+  p->num_segments = num_segments;
+  p->exec_inode = execip;
+  p->heap_start = heap_start;
+  p->next_seq = 0;
+  memset(p->advice, 0, sizeof(p->advice));
   
   // Simple logging for now
   // printf("[pid %d] DEBUG: EXEC completed successfully\n", p->pid);
@@ -203,6 +220,10 @@ kexec(char *path, char **argv)
   if(ip){
     iunlockput(ip);
     end_op();
+  } else if(execip){
+    begin_op();
+    iput(execip);
+    end_op();
   }
   return -1;
 }
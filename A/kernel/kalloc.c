@@ -8,6 +8,8 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "defs.h"
+#include "coremap.h"
+#include "memstat.h"
 
 void freerange(void *pa_start, void *pa_end);
 
@@ -18,18 +20,85 @@ struct run {
   struct run *next;
 };
 
-struct {
+// Each hart frees to and allocates from its own list, so the
+// common case takes only that hart's lock, which no other hart
+// wants unless it has run out. A hart holding more than KMEM_HIGH
+// free pages gives KMEM_BATCH of them to the shared pool; one that
+// runs dry takes a batch from the pool, or else steals from the
+// hart with the most.
+#define KMEM_BATCH 8
+#define KMEM_HIGH  32
+
+struct kmem {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;
+};
+
+struct kmem kmem[NCPU];
+struct kmem kpool;   // surplus pages, in batches
+int ksteals;         // batches stolen from another hart
+
+// Pages already filled with zeros, for kalloc_zeroed(). The
+// kzerod kernel thread tops the list up to KZERO_HIGH pages when
+// a hart has nothing else to run, as long as more than
+// KZERO_RESERVE pages would still be free for kalloc().
+#define KZERO_HIGH    16
+#define KZERO_RESERVE 32
+
+struct kmem kzero;
+
+// Megapages, for large anonymous regions (see mapmega() in vm.c).
+// kalloc() has far fewer than the 512 frames one takes, so
+// NMEGAPAGE of them are set aside past its frames, 2 MiB aligned,
+// with core map entries after its frames'. Each comes with a
+// page-table page kept for splitting it into ordinary pages, so
+// that walk() can split one without having to allocate. kzerod
+// clears free megapages in idle time: the fault handler only maps
+// one that is already clear. Replacement evicts a megapage by
+// splitting it; kfree() keeps the pages of a split megapage for
+// kalloc() to fall back on, and once it has all of them back the
+// megapage is whole again.
+struct {
+  struct spinlock lock;
+  uint64 base;               // first megapage
+  int npages[NMEGAPAGE];     // pages of it in use; 0 if free
+  char zeroed[NMEGAPAGE];    // free, and cleared by kzerod
+  void *split[NMEGAPAGE];    // page-table page to split it with
+  struct run *free[NMEGAPAGE]; // free pages of a split megapage
+  int nfree;                 // pages on those lists
+} kmega;
+
+static int kmega_index(uint64);
+static void kmega_put(int, void*);
+static struct run* kmega_take(void);
+static int kmega_zero(void);
+
+static struct run* ktake(struct kmem*, int);
+static void frame_setflags(struct frame*, int);
+static void kgive(struct kmem*, struct run*);
+static struct run* kzero_take(void);
+
+struct coremap coremap;
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, "kmem");
+  initlock(&kpool.lock, "kpool");
+  initlock(&kzero.lock, "kzero");
+  initlock(&kmega.lock, "kmega");
+  initlock(&coremap.lock, "coremap");
+  initlock(&coremap.picklock, "coremappick");
+  for(int i = 0; i < NCOREFRAME; i++)
+    coremap.frames[i].slot = -1;
   // Limit memory to force swapping during tests
-  // Allocate ~300 pages (~1.2MB) - enough for init but forces swapping
-  freerange(end, (void*)PGROUNDUP((uint64)end + 300*PGSIZE));
+  // Allocate NFRAME pages (~1.2MB) - enough for init but forces swapping
+  freerange(end, (void*)(PGROUNDUP((uint64)end) + NFRAME*PGSIZE));
+  kmega.base = MEGAROUNDUP(PGROUNDUP((uint64)end) + NFRAME*PGSIZE);
+  if(kmega.base + NMEGAPAGE*MEGAPGSIZE > PHYSTOP)
+    panic("kinit: megapages");
 }
 
 void
@@ -37,31 +106,137 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    pa2frame((uint64)p)->ref = 1;
     kfree(p);
+  }
 }
 
 // Free the page of physical memory pointed at by pa,
 // which normally should have been returned by a
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
+// A page shared with kdup() is freed when the
+// last reference to it goes. When one reference is
+// left, the page is marked FRAME_UNSHARED, for global
+// replacement to find the process that still maps it.
 void
 kfree(void *pa)
 {
   struct run *r;
+  struct frame *f;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  if((f = pa2frame((uint64)pa)) != 0){
+    acquire(&coremap.lock);
+    if(f->ref < 1)
+      panic("kfree: ref");
+    if(--f->ref > 0){
+      if(f->ref == 1 && (f->flags & FRAME_SHARED))
+        frame_setflags(f, FRAME_UNSHARED);
+      release(&coremap.lock);
+      return;
+    }
+    release(&coremap.lock);
+  }
+
+  frame_unmap((uint64)pa);
+
+#ifdef KDEBUG
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
+
+  int i = kmega_index((uint64)pa);
+  if(i >= 0){
+    kmega_put(i, pa);  // a page of a split megapage
+    return;
+  }
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  struct kmem *k = &kmem[cpuid()];
+  acquire(&k->lock);
+  r->next = k->freelist;
+  k->freelist = r;
+  k->nfree++;
+  if(k->nfree > KMEM_HIGH){
+    r = ktake(k, KMEM_BATCH);
+    release(&k->lock);
+    kgive(&kpool, r);
+  } else {
+    release(&k->lock);
+  }
+  pop_off();
+}
+
+// Detach up to n pages from the front of k's free list.
+// Caller holds k->lock.
+static struct run*
+ktake(struct kmem *k, int n)
+{
+  struct run *head = k->freelist, *r = head;
+
+  if(head == 0)
+    return 0;
+  for(; n > 1 && r->next; n--)
+    r = r->next;
+  k->freelist = r->next;
+  r->next = 0;
+  for(r = head; r; r = r->next)
+    k->nfree--;
+  return head;
+}
+
+// Put a list of pages from ktake() on k's free list.
+static void
+kgive(struct kmem *k, struct run *list)
+{
+  struct run *r;
+  int n = 0;
+
+  if(list == 0)
+    return;
+  for(r = list; ; r = r->next){
+    n++;
+    if(r->next == 0)
+      break;
+  }
+  acquire(&k->lock);
+  r->next = k->freelist;
+  k->freelist = list;
+  k->nfree += n;
+  release(&k->lock);
+}
+
+// Refill hart id's empty free list: a batch from the pool, or
+// half the pages of the hart that has the most.
+static void
+krefill(int id)
+{
+  struct run *list;
+  struct kmem *victim = 0;
+
+  acquire(&kpool.lock);
+  list = ktake(&kpool, KMEM_BATCH);
+  release(&kpool.lock);
+
+  if(list == 0){
+    for(int i = 0; i < NCPU; i++)
+      if(i != id && kmem[i].nfree > 0 && (victim == 0 || kmem[i].nfree > victim->nfree))
+        victim = &kmem[i];
+    if(victim == 0)
+      return;
+    acquire(&victim->lock);
+    list = ktake(victim, (victim->nfree + 1) / 2);
+    release(&victim->lock);
+    if(list)
+      __sync_fetch_and_add(&ksteals, 1);
+  }
+  kgive(&kmem[id], list);
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -72,13 +247,519 @@ kalloc(void)
 {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  push_off();
+  int id = cpuid();
+  struct kmem *k = &kmem[id];
+  if(k->freelist == 0)
+    krefill(id);
+  acquire(&k->lock);
+  r = k->freelist;
+  if(r){
+    k->freelist = r->next;
+    k->nfree--;
+  }
+  release(&k->lock);
+  pop_off();
+
+  if(r == 0)
+    r = kzero_take();  // zeroed pages are free memory too
+  if(r == 0)
+    r = kmega_take();  // and so are the pages of a split megapage
 
-  if(r)
+  if(r){
+#ifdef KDEBUG
     memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
+    pa2frame((uint64)r)->ref = 1;
+  }
+  return (void*)r;
+}
+
+// Take a page from the zeroed pool, or return 0.
+static struct run*
+kzero_take(void)
+{
+  struct run *r;
+
+  acquire(&kzero.lock);
+  r = ktake(&kzero, 1);
+  release(&kzero.lock);
+  return r;
+}
+
+// Allocate a page filled with zeros. Usually the page
+// comes from the pool kzerod keeps, so the caller does
+// not pay for clearing it.
+void *
+kalloc_zeroed(void)
+{
+  struct run *r;
+
+  if((r = kzero_take()) != 0){
+    // ktake() cleared r->next, the one word of the
+    // page the list used.
+    return (void*)r;
+  }
+  if((r = kalloc()) != 0)
+    memset((char*)r, 0, PGSIZE);
   return (void*)r;
 }
+
+// Free pages outside the zeroed pool, read without locks.
+static int
+kfreecount(void)
+{
+  int n = kpool.nfree;
+
+  for(int i = 0; i < NCPU; i++)
+    n += kmem[i].nfree;
+  return n;
+}
+
+// Number of pages kalloc() could give out now.
+int
+kfreepages(void)
+{
+  return kfreecount() + kzero.nfree + kmega.nfree;
+}
+
+// Whether the zeroed pool wants another page.
+static int
+kzero_low(void)
+{
+  return kzero.nfree < KZERO_HIGH && kfreecount() > KZERO_RESERVE;
+}
+
+// Whether kzerod has work to do: pages for the zeroed pool,
+// or a free megapage to clear.
+static int
+kzero_wanted(void)
+{
+  if(kzero_low())
+    return 1;
+  for(int i = 0; i < NMEGAPAGE; i++)
+    if(kmega.npages[i] == 0 && !kmega.zeroed[i])
+      return 1;
+  return 0;
+}
+
+// Called by the scheduler of a hart that found nothing
+// to run, so the zeroing is done in otherwise idle time.
+// Returns 1 if kzerod has been woken.
+int
+kzero_idle(void)
+{
+  if(!kzero_wanted())
+    return 0;
+  wakeup(&kzero);
+  return 1;
+}
+
+// Kernel thread that fills the zeroed pool and clears free
+// megapages, one page at a time, yielding between pages to
+// anything runnable.
+void
+kzerod(void)
+{
+  struct run *r;
+
+  for(;;){
+    acquire(&kzero.lock);
+    while(!kzero_wanted())
+      sleep(&kzero, &kzero.lock);
+    release(&kzero.lock);
+
+    if(!kzero_low()){
+      kmega_zero();
+      continue;
+    }
+    if((r = kalloc()) == 0)
+      continue;
+    memset((char*)r, 0, PGSIZE);
+    r->next = 0;
+    kgive(&kzero, r);
+    yield();
+  }
+}
+
+// Take another reference to page pa, which is about to be
+// shared copy-on-write. A shared page has no owner in the
+// core map, so global replacement leaves it alone.
+void
+kdup(void *pa)
+{
+  struct frame *f = pa2frame((uint64)pa);
+
+  if(f == 0)
+    panic("kdup");
+  acquire(&coremap.lock);
+  f->ref++;
+  f->owner = 0;
+  frame_setflags(f, FRAME_SHARED);
+  release(&coremap.lock);
+}
+
+// Number of references to page pa
+int
+krefcount(void *pa)
+{
+  struct frame *f = pa2frame((uint64)pa);
+
+  return f ? f->ref : 1;
+}
+
+// Return the core map entry for physical page pa,
+// or 0 if kalloc() does not manage pa.
+struct frame*
+pa2frame(uint64 pa)
+{
+  uint64 base = PGROUNDUP((uint64)end);
+
+  if(pa >= base && pa < base + NFRAME*PGSIZE)
+    return &coremap.frames[(pa - base) / PGSIZE];
+  if(kmega_index(pa) >= 0)
+    return &coremap.frames[NFRAME + (pa - kmega.base) / PGSIZE];
+  return 0;
+}
+
+// Return the physical page described by core map entry f.
+uint64
+frame2pa(struct frame *f)
+{
+  int i = f - coremap.frames;
+
+  if(i >= NFRAME)
+    return kmega.base + (uint64)(i - NFRAME)*PGSIZE;
+  return PGROUNDUP((uint64)end) + (uint64)i*PGSIZE;
+}
+
+// Record that process p maps physical page pa at va.
+// Does nothing while the page is shared.
+void
+frame_map(uint64 pa, struct proc *p, uint64 va)
+{
+  struct frame *f = pa2frame(pa);
+
+  if(f == 0)
+    return;
+  acquire(&coremap.lock);
+  if(f->ref > 1){
+    release(&coremap.lock);
+    return;
+  }
+  f->owner = p;
+  f->va = va;
+  f->seq = coremap.nextseq++;
+  f->age = 0x80;  // just referenced
+  frame_setflags(f, FRAME_USER);
+  release(&coremap.lock);
+}
+
+// Set f's flags, keeping count of the FRAME_UNSHARED ones.
+// Caller holds coremap.lock.
+static void
+frame_setflags(struct frame *f, int flags)
+{
+  if(f->flags & FRAME_UNSHARED)
+    coremap.nunshared--;
+  if(flags & FRAME_UNSHARED)
+    coremap.nunshared++;
+  f->flags = flags;
+}
+
+// Unshared page pa has no user to be found: the page cache
+// holds its last reference. Stop looking.
+void
+frame_disown(uint64 pa)
+{
+  struct frame *f = pa2frame(pa);
+
+  if(f == 0)
+    return;
+  acquire(&coremap.lock);
+  if(f->flags == FRAME_UNSHARED)
+    frame_setflags(f, 0);
+  release(&coremap.lock);
+}
+
+// Record that process p maps the megapage at pa whole, at va.
+void
+frame_map_mega(uint64 pa, struct proc *p, uint64 va)
+{
+  struct frame *f = pa2frame(pa);
+
+  if(f == 0 || kmega_index(pa) < 0)
+    panic("frame_map_mega");
+  acquire(&coremap.lock);
+  f->owner = p;
+  f->va = va;
+  f->seq = coremap.nextseq++;
+  f->age = 0x80;
+  f->flags = FRAME_USER | FRAME_MEGA;
+  release(&coremap.lock);
+}
+
+// Forget any mapping recorded for physical page pa,
+// and the swap copy of its contents, if any.
+void
+frame_unmap(uint64 pa)
+{
+  struct frame *f = pa2frame(pa);
+  int slot;
+
+  if(f == 0)
+    return;
+  acquire(&coremap.lock);
+  f->owner = 0;
+  f->va = 0;
+  frame_setflags(f, 0);
+  slot = f->slot;
+  f->slot = -1;
+  release(&coremap.lock);
+
+  if(slot >= 0)
+    swap_free_slot(slot);
+}
+
+// Record that swap slot holds a copy of physical page pa,
+// as it does when the page has just been read in from it.
+void
+frame_set_slot(uint64 pa, int slot)
+{
+  struct frame *f = pa2frame(pa);
+
+  if(f == 0)
+    panic("frame_set_slot");
+  acquire(&coremap.lock);
+  f->slot = slot;
+  release(&coremap.lock);
+}
+
+// Detach the swap copy of physical page pa, returning its
+// slot (now the caller's), or -1 if there is none.
+int
+frame_take_slot(uint64 pa)
+{
+  struct frame *f = pa2frame(pa);
+  int slot;
+
+  if(f == 0)
+    return -1;
+  acquire(&coremap.lock);
+  slot = f->slot;
+  f->slot = -1;
+  release(&coremap.lock);
+  return slot;
+}
+
+// Which megapage physical address pa lies in, or -1
+static int
+kmega_index(uint64 pa)
+{
+  if(pa < kmega.base || pa >= kmega.base + NMEGAPAGE*MEGAPGSIZE)
+    return -1;
+  return (pa - kmega.base) / MEGAPGSIZE;
+}
+
+// Take megapage i, free, for its caller: each of its pages
+// has the one reference kfree() will drop. Caller holds
+// kmega.lock.
+static void*
+kmega_alloc(int i)
+{
+  struct frame *f = &coremap.frames[NFRAME + i*MEGAFRAMES];
+
+  kmega.npages[i] = MEGAFRAMES;
+  kmega.zeroed[i] = 0;
+  kmega.split[i] = 0;
+  for(int j = 0; j < MEGAFRAMES; j++)
+    f[j].ref = 1;
+  return (void*)(kmega.base + i*MEGAPGSIZE);
+}
+
+// Allocate a megapage, not zeroed. Returns 0 if none is free.
+void *
+kalloc_mega(void)
+{
+  void *pa = 0;
+
+  acquire(&kmega.lock);
+  for(int i = 0; i < NMEGAPAGE; i++){
+    if(kmega.npages[i] == 0){
+      pa = kmega_alloc(i);
+      break;
+    }
+  }
+  release(&kmega.lock);
+  return pa;
+}
+
+// Allocate a megapage kzerod has cleared. Returns 0 if there
+// is none: clearing 2 MiB is too slow for the fault handler.
+void *
+kalloc_mega_zeroed(void)
+{
+  void *pa = 0;
+
+  acquire(&kmega.lock);
+  for(int i = 0; i < NMEGAPAGE; i++){
+    if(kmega.npages[i] == 0 && kmega.zeroed[i]){
+      pa = kmega_alloc(i);
+      break;
+    }
+  }
+  release(&kmega.lock);
+  return pa;
+}
+
+// Clear a free megapage for kalloc_mega_zeroed(), a page at a
+// time, yielding between pages. It is kept from everyone else
+// meanwhile. Returns 0 if there was none to clear.
+static int
+kmega_zero(void)
+{
+  int i;
+
+  acquire(&kmega.lock);
+  for(i = 0; i < NMEGAPAGE; i++)
+    if(kmega.npages[i] == 0 && !kmega.zeroed[i])
+      break;
+  if(i == NMEGAPAGE){
+    release(&kmega.lock);
+    return 0;
+  }
+  kmega.npages[i] = MEGAFRAMES;
+  release(&kmega.lock);
+
+  char *pa = (char*)(kmega.base + i*MEGAPGSIZE);
+  for(int j = 0; j < MEGAFRAMES; j++){
+    memset(pa + j*PGSIZE, 0, PGSIZE);
+    yield();
+  }
+
+  acquire(&kmega.lock);
+  kmega.npages[i] = 0;
+  kmega.zeroed[i] = 1;
+  release(&kmega.lock);
+  return 1;
+}
+
+// Give megapage pa the page-table page, from kalloc(), that
+// kmega_split() will hand back to split it with.
+void
+kmega_setsplit(void *pa, void *split)
+{
+  int i = kmega_index((uint64)pa);
+
+  acquire(&kmega.lock);
+  if(i < 0 || kmega.split[i])
+    panic("kmega_setsplit");
+  kmega.split[i] = split;
+  release(&kmega.lock);
+}
+
+// Megapage pa is about to be mapped as ordinary pages: return
+// the page-table page to map them with. From now on each page
+// has a core map entry of its own, taken from the megapage's,
+// and kfree() takes them one at a time.
+void *
+kmega_split(void *pa)
+{
+  int i = kmega_index((uint64)pa);
+  struct frame *f;
+  void *split;
+
+  acquire(&kmega.lock);
+  if(i < 0 || (split = kmega.split[i]) == 0)
+    panic("kmega_split");
+  kmega.split[i] = 0;
+  release(&kmega.lock);
+
+  f = pa2frame((uint64)pa);
+  acquire(&coremap.lock);
+  for(int j = 1; j < MEGAFRAMES; j++){
+    f[j].owner = f->owner;
+    f[j].va = f->va + j*PGSIZE;
+    f[j].seq = f->seq;
+    f[j].age = f->age;
+    f[j].flags = f->flags & FRAME_USER;
+  }
+  f->flags &= FRAME_USER;
+  release(&coremap.lock);
+  return split;
+}
+
+// A page of split megapage i is free. It waits for kalloc() on
+// the megapage's own list; the last of them makes the megapage
+// whole again.
+static void
+kmega_put(int i, void *pa)
+{
+  struct run *r = (struct run*)pa;
+
+  acquire(&kmega.lock);
+  if(kmega.npages[i] < 1)
+    panic("kmega_put");
+  if(--kmega.npages[i] == 0){
+    kmega.free[i] = 0;
+    kmega.nfree -= MEGAFRAMES - 1;
+  } else {
+    r->next = kmega.free[i];
+    kmega.free[i] = r;
+    kmega.nfree++;
+  }
+  release(&kmega.lock);
+}
+
+// Take a free page of a split megapage, or return 0.
+static struct run*
+kmega_take(void)
+{
+  struct run *r = 0;
+
+  acquire(&kmega.lock);
+  for(int i = 0; i < NMEGAPAGE; i++){
+    if((r = kmega.free[i]) != 0){
+      kmega.free[i] = r->next;
+      kmega.npages[i]++;
+      kmega.nfree--;
+      break;
+    }
+  }
+  release(&kmega.lock);
+  return r;
+}
+
+// Free a whole megapage that was never split.
+void
+kfree_mega(void *pa)
+{
+  int i = kmega_index((uint64)pa);
+  void *split;
+
+  if(i < 0 || ((uint64)pa % MEGAPGSIZE) != 0)
+    panic("kfree_mega");
+  frame_unmap((uint64)pa);
+  acquire(&kmega.lock);
+  if(kmega.npages[i] != MEGAFRAMES)
+    panic("kfree_mega: split");
+  kmega.npages[i] = 0;
+  split = kmega.split[i];
+  kmega.split[i] = 0;
+  release(&kmega.lock);
+
+  if(split)
+    kfree(split);
+}
+
+// Report the free page counts.
+void
+kallocstat(struct kalloc_stat *st)
+{
+  st->ncpu = NCPU < KSTAT_MAXCPU ? NCPU : KSTAT_MAXCPU;
+  for(int i = 0; i < st->ncpu; i++)
+    st->nfree[i] = kmem[i].nfree;
+  st->npool = kpool.nfree;
+  st->nzero = kzero.nfree;
+  st->nsteal = ksteals;
+}
@@ -17,6 +17,9 @@ main()
     printf("xv6 kernel is booting\n");
     printf("\n");
     kinit();         // physical page allocator
+    pcacheinit();    // executable text page cache
+    vmtraceinit();   // paging event trace
+    kswapdinit();    // background reclaim watermarks
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
     procinit();      // process table
@@ -29,6 +32,8 @@ main()
     fileinit();      // file table
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
+    kthread_create("kzerod", kzerod); // zeroes free pages when idle
+    kthread_create("kswapd", kswapd); // evicts pages when frames run low
     __sync_synchronize();
     started = 1;
   } else {
@@ -1,7 +1,19 @@
 #ifndef MEMSTAT_H
 #define MEMSTAT_H
 
-#define MAX_PAGES_INFO 128 // Max pages to report per syscall
+// Page-replacement policies (setpolicy)
+#define POLICY_DEFAULT -1 // follow the system-wide policy
+#define POLICY_FIFO     0
+#define POLICY_CLOCK    1 // second chance, using the accessed bit
+#define POLICY_AGING    2 // 8-bit aging counters fed by the accessed bit
+#define NPOLICY         3
+
+// Access-pattern hints (madvise)
+#define MADV_NORMAL     0
+#define MADV_RANDOM     1 // no fault-around or swap readahead
+#define MADV_SEQUENTIAL 2 // all the fault-around and readahead allowed; evict behind
+#define MADV_WILLNEED   3 // fault the range in now
+#define MADV_DONTNEED   4 // drop the pages: they come back zero-filled, or from the file
 
 // Page states
 #define UNMAPPED 0 
@@ -9,20 +21,43 @@
 #define SWAPPED  2
 
 struct page_stat {
-  uint va;    
-  int state;  
-  int is_dirty; 
-  int seq;     
-  int swap_slot; 
+  uint64 va;
+  int state;
+  int is_dirty;   // differs from its copy in swap or the executable
+  int seq;        // FIFO sequence number, or -1 if not in the ring
+  int swap_slot;  // where it is, or a clean copy of it is, or -1
+  int referenced; // accessed bit (Clock, Aging)
+  int age;        // aging counter (Aging)
 };
 
+// memstat(st, pages, n, va) fills in st, and pages[] with up to n
+// of the resident or swapped pages from va on. To see them all,
+// start at 0 and call again from st->next_va until it is 0.
 struct proc_mem_stat {
   int pid;
-  int num_pages_total;     
+  int num_pages_total;     // pages below the process size
   int num_resident_pages; 
+  int resident_limit;      // resident-set limit, as PFF has set it
   int num_swapped_pages;   
   int next_fifo_seq;       
-  struct page_stat pages[MAX_PAGES_INFO];
+  int policy;              // replacement policy in effect
+  int num_faults;          // page faults taken so far
+  int readahead_window;    // pages a swap-in fault may read
+  int readahead_hits;      // pages read ahead and then used
+  int readahead_misses;    // pages read ahead for nothing
+  int num_pages;           // entries filled in pages[]
+  uint64 next_va;          // where to continue, or 0 if done
+};
+
+// Free page counts (kallocstat)
+#define KSTAT_MAXCPU 8
+
+struct kalloc_stat {
+  int ncpu;         // entries used in nfree[]
+  int nfree[KSTAT_MAXCPU];  // pages on each hart's free list
+  int npool;        // pages in the shared pool
+  int nzero;        // pre-zeroed pages kept for kalloc_zeroed()
+  int nsteal;       // batches one hart took from another's list
 };
 
 #endif
\ No newline at end of file
@@ -10,6 +10,18 @@
 #define LOGBLOCKS    (MAXOPBLOCKS*3)  // max data blocks in on-disk log
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE       2000  // size of file system in blocks
+#define SWAPSIZE     4096  // default size of swap area in blocks (mkfs -s)
+#define MAXSWAPSLOT  16384 // most swap slots (pages) the kernel can use
 #define MAXPATH      128   // maximum file path name
 #define USERSTACK    1     // user stack pages
+#define NFRAME       300   // physical pages given to kalloc (forces swapping)
+#define FREELOW      16    // default free frames below which kswapd runs
+#define FREEHIGH     40    // default free frames kswapd stops at
+#define FAULTAROUND  4     // default extra pages mapped on a text/data fault
+#define MAXFAULTAROUND 16  // most a process may ask for
+#define NPCACHE      32    // pages in the executable text cache
+#define NVMTRACE     512   // paging trace records kept per hart
+#define SWAPCLUSTER  4     // most pages in one swap read or write
+#define ZPOOLPAGES   16    // frames holding compressed swapped pages
+#define NMEGAPAGE    4     // 2 MiB pages for large anonymous regions
 
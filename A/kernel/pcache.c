@@ -0,0 +1,119 @@
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+#include "fs.h"
+#include "file.h"
+
+// Page cache for executable text and read-only mapped files.
+//
+// Processes running the same program map its read-only text pages
+// from one shared frame, as do processes that mmap() the same part
+// of a file read-only. An entry names a page by the executable's
+// inode and the byte range of the file it holds, and keeps a
+// reference to the frame (see kdup()), so that the page outlives
+// the processes using it until memory runs short. Writing to or
+// truncating the file drops its pages from the cache; processes
+// that have them mapped keep their old copies.
+
+struct pcpage {
+  uint dev;
+  uint inum;
+  uint off;      // file offset of the page's contents
+  uint len;      // bytes from the file; the rest is zero
+  uint64 pa;     // the frame, or 0 if the entry is free
+};
+
+struct {
+  struct spinlock lock;
+  struct pcpage pages[NPCACHE];
+} pcache;
+
+void pcacheinit(void) {
+  initlock(&pcache.lock, "pcache");
+}
+
+// Look up the page holding len bytes of ip at off. Returns the frame
+// with a reference taken for the caller to map, or 0 on a miss.
+uint64 pcache_get(struct inode *ip, uint off, uint len) {
+  uint64 pa = 0;
+
+  acquire(&pcache.lock);
+  for(struct pcpage *c = pcache.pages; c < &pcache.pages[NPCACHE]; c++) {
+    if(c->pa && c->dev == ip->dev && c->inum == ip->inum && c->off == off && c->len == len) {
+      pa = c->pa;
+      kdup((void*)pa);
+      break;
+    }
+  }
+  release(&pcache.lock);
+  return pa;
+}
+
+// Offer a page just read from ip to the cache. Returns 1 if the
+// cache took a reference to it (and it is now shared), 0 if the
+// cache is full of pages in use.
+int pcache_put(struct inode *ip, uint off, uint len, uint64 pa) {
+  struct pcpage *c, *victim = 0;
+
+  acquire(&pcache.lock);
+  for(c = pcache.pages; c < &pcache.pages[NPCACHE]; c++) {
+    if(c->pa == 0) {
+      victim = c;
+      break;
+    }
+    if(victim == 0 && krefcount((void*)c->pa) == 1)
+      victim = c;  // nobody maps it but the cache
+  }
+  if(victim == 0) {
+    release(&pcache.lock);
+    return 0;
+  }
+  if(victim->pa)
+    kfree((void*)victim->pa);
+  victim->dev = ip->dev;
+  victim->inum = ip->inum;
+  victim->off = off;
+  victim->len = len;
+  victim->pa = pa;
+  kdup((void*)pa);
+  ip->pcached = 1;
+  release(&pcache.lock);
+  return 1;
+}
+
+// Free the cached pages no process maps. Returns how many.
+int pcache_shrink(void) {
+  int n = 0;
+
+  acquire(&pcache.lock);
+  for(struct pcpage *c = pcache.pages; c < &pcache.pages[NPCACHE]; c++) {
+    if(c->pa && krefcount((void*)c->pa) == 1) {
+      kfree((void*)c->pa);
+      c->pa = 0;
+      n++;
+    }
+  }
+  release(&pcache.lock);
+  return n;
+}
+
+// Drop ip's pages from the cache; its contents are changing.
+// The file system calls this only while ip->pcached says there
+// may be some, so that writing to files never run or mapped
+// doesn't search the cache.
+void pcache_invalidate(struct inode *ip) {
+  acquire(&pcache.lock);
+  ip->pcached = 0;
+  for(struct pcpage *c = pcache.pages; c < &pcache.pages[NPCACHE]; c++) {
+    if(c->pa && c->dev == ip->dev && c->inum == ip->inum) {
+      kfree((void*)c->pa);
+      c->pa = 0;
+    }
+  }
+  release(&pcache.lock);
+}
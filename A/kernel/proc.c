@@ -5,6 +5,7 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "memstat.h"
 
 struct cpu cpus[NCPU];
 
@@ -104,10 +105,10 @@ allocpid()
 
 // Look in the process table for an UNUSED proc.
 // If found, initialize state required to run in the kernel,
-// and return with p->lock held.
-// If there are no free procs, or a memory allocation fails, return 0.
+// and return with p->lock held. The proc has no trapframe or
+// user page table yet. If there are no free procs, return 0.
 static struct proc*
-allocproc(void)
+allocslot(void)
 {
   struct proc *p;
 
@@ -126,13 +127,38 @@ found:
   p->state = USED;
   
   // Initialize demand paging fields
+  p->res_head = 0;
   p->num_resident = 0;
+  p->rss_limit = MAX_RESIDENT_PAGES / 2;
+  p->last_fault = r_time();
   p->next_seq = 1;
-  p->num_swapped = 0;
-  p->swap_file = 0;
+  p->policy = POLICY_DEFAULT;
+  p->num_faults = 0;
+  p->in_fault = 0;
+  p->fault_around = FAULTAROUND;
+  memset(&p->ra, 0, sizeof(p->ra));
+  p->ra.window = SWAPCLUSTER;
+  memset(p->advice, 0, sizeof(p->advice));
   p->exec_inode = 0;
   p->heap_start = 0;
 
+  memset(&p->context, 0, sizeof(p->context));
+  p->context.sp = p->kstack + PGSIZE;
+
+  return p;
+}
+
+// Allocate a proc that will run in user space.
+// Returns with p->lock held, or 0 if there are no free procs
+// or a memory allocation fails.
+static struct proc*
+allocproc(void)
+{
+  struct proc *p;
+
+  if((p = allocslot()) == 0)
+    return 0;
+
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
     freeproc(p);
@@ -150,9 +176,7 @@ found:
 
   // Set up new context to start executing at forkret,
   // which returns to user space.
-  memset(&p->context, 0, sizeof(p->context));
   p->context.ra = (uint64)forkret;
-  p->context.sp = p->kstack + PGSIZE;
 
   return p;
 }
@@ -170,9 +194,6 @@ freeproc(struct proc *p)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
   
-  // Clean up swap file
-  swap_cleanup(p);
-  
   // Release reference to executable
   if(p->exec_inode) {
     iput(p->exec_inode);
@@ -180,14 +201,15 @@ freeproc(struct proc *p)
   }
   
   // Clear demand paging fields
+  p->res_head = 0;
   p->num_resident = 0;
-  p->num_swapped = 0;
   p->next_seq = 1;
   
   p->sz = 0;
   p->pid = 0;
   p->parent = 0;
   p->name[0] = 0;
+  p->kthread = 0;
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
@@ -254,6 +276,37 @@ userinit(void)
   release(&p->lock);
 }
 
+// A kernel thread's first scheduling swtches here.
+static void
+kthreadstart(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+  p->kthread();
+  panic("kthread returned");
+}
+
+// Start a kernel thread running fn, which must not return.
+// It is a process that never leaves the kernel, so it gets no
+// trapframe or user page table; it costs only its proc[] slot
+// and kernel stack. It has no parent, so wait() never sees it,
+// and kill() refuses it.
+void
+kthread_create(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocslot()) == 0)
+    panic("kthread_create");
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->kthread = fn;
+  p->context.ra = (uint64)kthreadstart;
+  p->state = RUNNABLE;
+  release(&p->lock);
+}
+
 // Shrink user memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
@@ -267,8 +320,14 @@ growproc(int n)
     if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
       return -1;
     }
+    frame_map_range(p, p->sz, sz);
   } else if(n < 0){
     sz = uvmdealloc(p->pagetable, sz, sz + n);
+    resident_drop_range(p, PGROUNDUP(sz), PGROUNDUP(p->sz));
+    advice_clip(p, PGROUNDUP(sz));
+    begin_op();
+    mmap_release(p, PGROUNDUP(sz));  // files mapped above the new end
+    end_op();
   }
   p->sz = sz;
   return 0;
@@ -288,25 +347,37 @@ kfork(void)
     return -1;
   }
 
-  // Copy user memory from parent to child.
+  // Copy user memory from parent to child. uvmcopy() may
+  // take a while copying pages, so drop np->lock; np
+  // stays USED, so nothing else will touch it meanwhile.
+  release(&np->lock);
   if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+    acquire(&np->lock);
     freeproc(np);
     release(&np->lock);
     return -1;
   }
   np->sz = p->sz;
+  frame_map_range(np, 0, np->sz);
   
-  // Copy demand paging fields from parent
-  np->num_resident = 0;  // Child starts with no resident pages
-  np->next_seq = 1;
-  np->num_swapped = 0;
-  np->swap_file = 0;  // Each process gets its own swap file
+  // Copy demand paging fields from parent. The child's ring
+  // starts empty: its pages are shared copy-on-write with the
+  // parent, and join its ring as it writes to them.
+  np->res_head = 0;
+  np->num_resident = 0;
+  np->rss_limit = p->rss_limit;
+  np->next_seq = p->next_seq;
+  np->policy = p->policy;
+  np->fault_around = p->fault_around;
+  memmove(np->advice, p->advice, sizeof(p->advice));
   np->heap_start = p->heap_start;
   
   // Copy segments from parent to child
   np->num_segments = p->num_segments;
   for(i = 0; i < p->num_segments; i++) {
     np->segments[i] = p->segments[i];
+    if(np->segments[i].ip)
+      idup(np->segments[i].ip);  // a mapped file
   }
   
   // Duplicate reference to executable inode
@@ -332,8 +403,6 @@ kfork(void)
 
   pid = np->pid;
 
-  release(&np->lock);
-
   acquire(&wait_lock);
   np->parent = p;
   release(&wait_lock);
@@ -381,13 +450,11 @@ kexit(int status)
   }
 
   begin_op();
+  mmap_release(p, 0);
   iput(p->cwd);
   end_op();
   p->cwd = 0;
 
-  // Cleanup swap resources
-  swap_cleanup(p);
-
   acquire(&wait_lock);
 
   // Give any children to init.
@@ -498,8 +565,10 @@ scheduler(void)
       }
       release(&p->lock);
     }
-    if(found == 0) {
-      // nothing to run; stop running on this core until an interrupt.
+    // with nothing to run, give kzerod the time; if it has
+    // nothing to do either, stop running on this core until
+    // an interrupt.
+    if(found == 0 && kzero_idle() == 0) {
       asm volatile("wfi");
     }
   }
@@ -640,6 +709,10 @@ kkill(int pid)
   for(p = proc; p < &proc[NPROC]; p++){
     acquire(&p->lock);
     if(p->pid == pid){
+      if(p->kthread){
+        release(&p->lock);
+        return -1;
+      }
       p->killed = 1;
       if(p->state == SLEEPING){
         // Wake process from sleep().
@@ -728,6 +801,8 @@ procdump(void)
     else
       state = "???";
     printf("%d %s %s", p->pid, state, p->name);
+    if(p->kthread)
+      printf(" (kthread)");
     printf("\n");
   }
 }
@@ -88,6 +88,7 @@ struct resident_page {
   int seq;           // FIFO sequence number
   int is_dirty;      // Dirty bit (1 if written since brought in)
   int swap_slot;     // Slot in swap file (-1 if not swapped)
+  int age;           // Aging counter (Aging policy)
 };
 
 // Text/data segment info for lazy loading
@@ -98,11 +99,38 @@ struct segment {
   uint64 file_size;   // Size in file
   uint64 mem_size;    // Size in memory (may be larger than file_size)
   int flags;          // ELF flags (for permissions)
+  struct inode *ip;   // file mapped by mmap(), or 0 for the executable
 };
 
+// Resident-set limits, which page-fault frequency moves between
+// MIN_RESIDENT_PAGES and MAX_RSS_LIMIT (see pff_update()). At most
+// MAX_RESIDENT_PAGES of them are ordinary pages; the rest of a limit
+// above that can only be taken up by a megapage.
 #define MAX_RESIDENT_PAGES 64
-#define MAX_SWAP_PAGES 256 
-#define MAX_SEGMENTS 4
+#define MIN_RESIDENT_PAGES 8
+#define MAX_RSS_LIMIT (MAX_RESIDENT_PAGES + MEGAPGSIZE/PGSIZE)
+#define PFF_INTERVAL 100000  // time CSR ticks (10ms) between "frequent" faults
+#define PFF_MINFREE  16      // free frames needed for a limit to grow
+#define MAX_SEGMENTS 8  // ELF segments and mmap()ed files
+
+// madvise() hint for a range of the address space
+struct advice {
+  uint64 start;                // [start, end), page-aligned
+  uint64 end;                  // 0 if the entry is unused
+  int advice;                  // MADV_RANDOM or MADV_SEQUENTIAL
+};
+#define MAX_ADVICE 4
+
+// Swap-in readahead state (see readahead_adapt())
+struct readahead {
+  int window;                  // pages a swap-in fault may read
+  uint64 va;                   // first page read ahead at the last one
+  int n;                       // and how many
+  int used;                    // of them, seen referenced: a bit each
+  uint64 next;                 // the page after the last one
+  int hits;                    // pages read ahead that were used
+  int misses;                  // and that weren't
+};
 
 // Per-process state
 struct proc {
@@ -127,19 +155,26 @@ struct proc {
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  void (*kthread)(void);       // Kernel thread's function, or 0
   
   // Simplified demand paging fields
+  struct resident_page resident[MAX_RESIDENT_PAGES]; // FIFO ring of resident pages
+  int res_head;                // Oldest entry in resident[]
   int num_resident;            // Number of resident pages
+  int rss_limit;               // Most resident pages allowed (PFF)
+  uint64 last_fault;           // time CSR at last fault needing a frame
   int next_seq;                // Next FIFO sequence number
-  int num_swapped;             // Number of swapped pages
-  struct file *swap_file;      // Swap file handle
+  int policy;                  // Replacement policy, or POLICY_DEFAULT
+  int num_faults;              // Page faults taken
+  int in_fault;                // In the fault handler; see demand.c
+  int fault_type;              // Kind of fault being served (FT_*)
+  int fault_around;            // Extra pages to map on a text/data fault
+  struct readahead ra;         // Swap-in readahead
+  struct advice advice[MAX_ADVICE]; // Ranges with madvise() hints
   struct inode *exec_inode;    // Reference to executable file
   uint64 heap_start;           // Heap start
   
   // ELF segment info for lazy loading
   struct segment segments[MAX_SEGMENTS];  // Text/data segments
   int num_segments;            // Number of segments
-  
-  // Swap slot management
-  char swap_slots[MAX_SWAP_PAGES];  // Bitmap of used swap slots
 };
@@ -7,125 +7,289 @@
 #include "proc.h"
 #include "defs.h"
 #include "fs.h"
-#include "file.h"
-#include "fcntl.h"
-#include "stat.h"
+#include "buf.h"
+#include "vmtrace.h"
 
+// Swap area on the disk.
+//
+// mkfs reserves sb.nswap blocks starting at sb.swapstart, past the
+// end of the file system (mkfs -s sets how many). The area is split
+// into page-sized slots, shared by all processes. A bitmap records
+// which slots are in use, so finding a free one looks at 64 slots a
+// word at a time. Each slot counts the swap entries and frames that
+// name it: fork shares a swapped page's slot with the child, and the
+// slot is free once the last of them lets go.
+// Swap I/O goes straight to the disk, a page per descriptor: it
+// bypasses both the buffer cache and the log, since swapped pages
+// need neither caching nor crash recovery. Pages evicted from
+// neighbouring addresses are put in neighbouring slots where they
+// can be, so that the fault handler can read several back in one
+// request (see swap_in_fault()).
+// Before a page goes to the disk it is offered to the compressed
+// cache in zswap.c; one kept there is read back from memory, and is
+// written to its slot only if the cache has to make room for others.
 
-// Initialize swap management for a process
-int swap_init(struct proc *p) {
-  if(p->swap_file) {
-    return 0; // Already initialized
+#define BPP (PGSIZE / BSIZE)             // disk blocks per page
+#define NMAPWORD ((MAXSWAPSLOT + 63) / 64)
+#define SLOTWORD(slot) ((slot) / 64)
+#define SLOTBIT(slot) (1UL << ((slot) % 64))
+
+struct {
+  struct spinlock lock;
+  uint dev;
+  uint start;                   // first block of the swap area
+  int nslot;                    // number of usable slots
+  int nused;                    // slots in use
+  int hint;                     // map word to start looking in
+  uint64 map[NMAPWORD];         // slot in use (referenced or busy)
+  uint64 busy[NMAPWORD];        // slot reserved, page not written yet
+  uchar ref[MAXSWAPSLOT];       // swap entries and frames naming it
+  struct buf buf;               // stands for the swap I/O request
+  struct sleeplock wblock;      // guards wbpage
+} swap;
+
+// A page on its way from the compressed cache to the disk
+static char wbpage[PGSIZE] __attribute__((aligned(PGSIZE)));
+
+// Set up the swap area described by the super block.
+void swapinit(int dev, struct superblock *sb) {
+  initlock(&swap.lock, "swap");
+  initsleeplock(&swap.buf.lock, "swapbuf");
+  initsleeplock(&swap.wblock, "swapwb");
+  swap.dev = dev;
+  swap.start = sb->swapstart;
+  swap.nslot = sb->nswap / BPP;
+  if(swap.nslot > MAXSWAPSLOT) {
+    printf("swap: using %d of %d slots\n", MAXSWAPSLOT, swap.nslot);
+    swap.nslot = MAXSWAPSLOT;
   }
-  
-  // For simplicity, just use a static swap "file" (memory buffer)
-  // In a real implementation, this would create a file on disk
-  p->num_swapped = 0;
-  
-  // Initialize swap slot bitmap
-  memset(p->swap_slots, 0, sizeof(p->swap_slots));
-  
-  // For now, we'll use a simple in-memory approach
-  // In a full implementation, this would open/create an actual swap file
-  p->swap_file = (struct file*)1; // Mark as initialized
-  
-  return 0;
+  // slots past the end are never free
+  for(int i = swap.nslot; i < NMAPWORD*64; i++)
+    swap.map[SLOTWORD(i)] |= SLOTBIT(i);
+  zswapinit();
 }
 
-// Cleanup swap file for a process
-void swap_cleanup(struct proc *p) {
-  if (p->swap_file) {
-    int freed_slots = 0;
-    // Count used slots
-    for(int i = 0; i < MAX_SWAP_PAGES; i++) {
-      if(p->swap_slots[i]) {
-        freed_slots++;
-      }
-    }
-    printf("[pid %d] SWAPCLEANUP freed_slots=%d\n", p->pid, freed_slots);
-    
-    // In a real implementation, this would close the swap file
-    // fileclose(p->swap_file);
-    p->swap_file = 0;
-    memset(p->swap_slots, 0, sizeof(p->swap_slots));
+// Index of the lowest clear bit in w, which must have one
+static int ffz(uint64 w) {
+  int b = 0;
+
+  w = ~w;
+  if((w & 0xffffffff) == 0) { b += 32; w >>= 32; }
+  if((w & 0xffff) == 0) { b += 16; w >>= 16; }
+  if((w & 0xff) == 0) { b += 8; w >>= 8; }
+  if((w & 0xf) == 0) { b += 4; w >>= 4; }
+  if((w & 0x3) == 0) { b += 2; w >>= 2; }
+  if((w & 0x1) == 0) b += 1;
+  return b;
+}
+
+// Mark slot free if nothing holds it. Caller holds swap.lock.
+static void slot_release(int slot) {
+  if(swap.ref[slot] == 0 && (swap.busy[SLOTWORD(slot)] & SLOTBIT(slot)) == 0) {
+    swap.map[SLOTWORD(slot)] &= ~SLOTBIT(slot);
+    swap.nused--;
+    zswap_drop(slot);
   }
-  p->num_swapped = 0;
 }
 
-// Check if a swap slot is in use
-int swap_slot_is_used(struct proc *p, int slot) {
-  if(slot < 0 || slot >= MAX_SWAP_PAGES)
-    return 0;
-  return p->swap_slots[slot];
+// The write into slot is done, or was never needed. Caller
+// holds swap.lock, and must wake up any swap_in_pages() waiting
+// for the slot once it has let go: wakeup() takes p->lock, which
+// the evicting side holds while it allocates and frees slots.
+static void slot_written(int slot) {
+  swap.busy[SLOTWORD(slot)] &= ~SLOTBIT(slot);
+  slot_release(slot);  // in case the owner exited meanwhile
 }
 
-// Mark a swap slot as used
-void swap_slot_set_used(struct proc *p, int slot) {
-  if(slot >= 0 && slot < MAX_SWAP_PAGES)
-    p->swap_slots[slot] = 1;
+// Read or write the pages of n slots from slot on, in one
+// disk request.
+static void swaprw(int slot, char **pages, int n, int write) {
+  struct buf *b = &swap.buf;
+
+  acquiresleep(&b->lock);
+  b->dev = swap.dev;
+  b->blockno = swap.start + slot*BPP;
+  virtio_disk_rwv(b, pages, n, PGSIZE, write);
+  releasesleep(&b->lock);
 }
 
-// Mark a swap slot as free
-void swap_slot_set_free(struct proc *p, int slot) {
-  if(slot >= 0 && slot < MAX_SWAP_PAGES)
-    p->swap_slots[slot] = 0;
+// Make room in the compressed cache by writing its least
+// recently used page to the disk. Returns -1 if it is empty.
+// The page stays in the cache until it is on the disk, its
+// slot busy meanwhile, so that a fault on it waits.
+static int swap_writeback(void) {
+  char *page = wbpage;
+  int slot;
+
+  acquiresleep(&swap.wblock);
+  acquire(&swap.lock);
+  if((slot = zswap_oldest()) >= 0)
+    swap.busy[SLOTWORD(slot)] |= SLOTBIT(slot);
+  release(&swap.lock);
+  if(slot >= 0) {
+    if(zswap_copy(slot, wbpage) < 0)
+      panic("swap_writeback");
+    swaprw(slot, &page, 1, 1);
+    acquire(&swap.lock);
+    zswap_drop(slot);
+    slot_written(slot);
+    release(&swap.lock);
+    wakeup(&swap.ref[slot]);
+  }
+  releasesleep(&swap.wblock);
+  return slot < 0 ? -1 : 0;
 }
 
-// Find a free swap slot
-int swap_alloc_slot(struct proc *p) {
-  for (int slot = 0; slot < MAX_SWAP_PAGES; slot++) {
-    if (!swap_slot_is_used(p, slot)) {
-      swap_slot_set_used(p, slot);
-      return slot;
+// Keep the page bound for slot in the compressed cache, making
+// room if need be. Returns -1 if it must go to the disk instead.
+// The page is compressed without swap.lock: the slot is busy,
+// so nothing else looks at it meanwhile.
+static int swap_store(int slot, char *page) {
+  int r;
+
+  for(;;) {
+    if((r = zswap_put(slot, page)) == 0) {
+      acquire(&swap.lock);
+      slot_written(slot);
+      release(&swap.lock);
+      wakeup(&swap.ref[slot]);
     }
+    if(r != -2)
+      return r;
+    if(swap_writeback() < 0)
+      return -1;
   }
-  return -1; // No free slots
 }
 
-// Write a page to swap (simplified for testing)
-int swap_out_page(struct proc *p, uint64 va, uint64 pa) {
-  if (!p->swap_file) {
-    if (swap_init(p) < 0) {
-      return -1;
+// Report swap slots in use, out of how many, and how the
+// compressed cache is doing
+void swap_stat(struct vmstat *st) {
+  acquire(&swap.lock);
+  st->swap_used = swap.nused;
+  st->swap_slots = swap.nslot;
+  zswap_stat(st);
+  release(&swap.lock);
+}
+
+// Take another reference to a slot, for a copy of a swap entry
+void swap_dup(int slot) {
+  if(slot < 0 || slot >= swap.nslot)
+    panic("swap_dup");
+  acquire(&swap.lock);
+  if(swap.ref[slot] == 0 || swap.ref[slot] == 255)
+    panic("swap_dup: ref");
+  swap.ref[slot]++;
+  release(&swap.lock);
+}
+
+// Drop a reference to a slot named by a swap PTE or a frame
+void swap_free_slot(int slot) {
+  if(slot < 0 || slot >= swap.nslot)
+    return;
+  acquire(&swap.lock);
+  if(swap.ref[slot] == 0)
+    panic("swap_free_slot");
+  swap.ref[slot]--;
+  slot_release(slot);
+  release(&swap.lock);
+}
+
+// Find a free swap slot, with one reference, reserved until
+// swap_write_pages() has written it: slot near if that is free,
+// else the first free one. Returns -1 if swap is full.
+int swap_alloc_slot(int near) {
+  int nword = (swap.nslot + 63) / 64;
+  int slot = -1;
+
+  acquire(&swap.lock);
+  if(near >= 0 && near < swap.nslot && (swap.map[SLOTWORD(near)] & SLOTBIT(near)) == 0) {
+    slot = near;
+  } else {
+    for(int n = 0; n < nword; n++) {
+      int w = (swap.hint + n) % nword;
+      if(swap.map[w] != ~0UL) {
+        slot = w*64 + ffz(swap.map[w]);
+        swap.hint = w;
+        break;
+      }
     }
   }
-  
-  // Find a free swap slot
-  int slot = swap_alloc_slot(p);
-  if (slot < 0) {
-    // No free slots - log and terminate process
-    printf("[pid %d] SWAPFULL\n", p->pid);
-    return -1;
+  if(slot >= 0) {
+    swap.map[SLOTWORD(slot)] |= SLOTBIT(slot);
+    swap.busy[SLOTWORD(slot)] |= SLOTBIT(slot);
+    swap.ref[slot] = 1;
+    swap.nused++;
+  }
+  release(&swap.lock);
+  return slot;  // -1: no free slots
+}
+
+// Write n pages into slots from swap_alloc_slot(), consecutive
+// from slot on. Those the compressed cache won't take go to the
+// disk, a request per run of them.
+void swap_write_pages(char **pages, int n, int slot) {
+  int i = 0, j;
+
+  while(i < n) {
+    for(j = i; j < n && swap_store(slot + j, pages[j]) < 0; j++)
+      ;
+    if(j > i) {
+      swaprw(slot + i, pages + i, j - i, 1);
+      acquire(&swap.lock);
+      for(int k = i; k < j; k++)
+        slot_written(slot + k);
+      release(&swap.lock);
+      for(int k = i; k < j; k++)
+        wakeup(&swap.ref[slot + k]);
+    }
+    i = j + 1;  // pages[j] is in the cache
   }
-  
-  // For testing purposes, we'll just simulate the swap out
-  // In a real implementation, this would write to a swap file
-  p->num_swapped++;
-  printf("[pid %d] SWAPOUT va=0x%lx slot=%d\n", p->pid, va, slot);
-  
-  return slot;
 }
 
-// Read a page from swap (simplified for testing)
-int swap_in_page(struct proc *p, uint64 va, uint64 pa, int slot) {
-  if (!p->swap_file || slot < 0 || slot >= MAX_SWAP_PAGES) {
+// Read p's page at va back from swap into pages[0], and the
+// pages of the n-1 slots after it into the rest of pages[].
+// The references stay with the pages: while one is clean, it
+// can be evicted again without writing it out.
+int swap_in_pages(struct proc *p, uint64 va, char **pages, int n, int slot) {
+  uint64 cached = 0;
+  int i, j;
+
+  if(slot < 0 || slot + n > swap.nslot)
     return -1;
+  acquire(&swap.lock);
+  for(i = 0; i < n; i++) {
+    if(swap.ref[slot + i] == 0) {
+      release(&swap.lock);
+      return -1; // Slot not in use
+    }
   }
-  
-  if (!swap_slot_is_used(p, slot)) {
-    return -1; // Slot not in use
+  // Global replacement points a PTE at a slot before writing the
+  // page out, so the owner may fault on the page while the write
+  // is in progress: wait for it.
+  for(i = 0; i < n; i++) {
+    if(swap.busy[SLOTWORD(slot + i)] & SLOTBIT(slot + i)) {
+      sleep(&swap.ref[slot + i], &swap.lock);
+      i = -1;
+    }
   }
-  
-  // For testing purposes, we'll just simulate the swap in
-  // In a real implementation, this would read from a swap file
-  // Just zero-fill the page for now
-  memset((void*)pa, 0, PGSIZE);
-  
-  // Free the swap slot
-  swap_slot_set_free(p, slot);
-  p->num_swapped--;
-  
-  printf("[pid %d] SWAPIN va=0x%lx slot=%d\n", p->pid, va, slot);
-  
+  release(&swap.lock);
+
+  // expanding a compressed page needs no swap.lock: the pages'
+  // references keep the slots, and a writeback drops a page from
+  // the cache only once it is on the disk.
+  for(i = 0; i < n; i++)
+    if(zswap_get(slot + i, pages[i]) == 0)
+      cached |= 1UL << i;
+
+  // read the rest from the disk, a request per run
+  for(i = 0; i < n; i = j + 1) {
+    for(j = i; j < n && (cached & (1UL << j)) == 0; j++)
+      ;
+    if(j > i)
+      swaprw(slot + i, pages + i, j - i, 0);
+  }
+
+  vmlog(p, VT_SWAPIN, va, slot, 0);
+
   return 0;
 }
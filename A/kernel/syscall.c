@@ -102,6 +102,16 @@ extern uint64 sys_link(void);
 extern uint64 sys_mkdir(void);
 extern uint64 sys_close(void);
 extern uint64 sys_memstat(void);
+extern uint64 sys_setpolicy(void);
+extern uint64 sys_setfaultaround(void);
+extern uint64 sys_kallocstat(void);
+extern uint64 sys_vmtrace(void);
+extern uint64 sys_vmverbose(void);
+extern uint64 sys_vmstat(void);
+extern uint64 sys_faultlat(void);
+extern uint64 sys_setwatermarks(void);
+extern uint64 sys_madvise(void);
+extern uint64 sys_mmap(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -128,6 +138,16 @@ static uint64 (*syscalls[])(void) = {
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
 [SYS_memstat] sys_memstat,
+[SYS_setpolicy] sys_setpolicy,
+[SYS_setfaultaround] sys_setfaultaround,
+[SYS_kallocstat] sys_kallocstat,
+[SYS_vmtrace] sys_vmtrace,
+[SYS_vmverbose] sys_vmverbose,
+[SYS_vmstat] sys_vmstat,
+[SYS_faultlat] sys_faultlat,
+[SYS_setwatermarks] sys_setwatermarks,
+[SYS_madvise] sys_madvise,
+[SYS_mmap] sys_mmap,
 };
 
 void
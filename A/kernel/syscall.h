@@ -21,3 +21,13 @@
 #define SYS_mkdir  20
 #define SYS_close  21
 #define SYS_memstat 22
+#define SYS_setpolicy 23
+#define SYS_setfaultaround 24
+#define SYS_kallocstat 25
+#define SYS_vmtrace 26
+#define SYS_vmverbose 27
+#define SYS_vmstat 28
+#define SYS_faultlat 29
+#define SYS_setwatermarks 30
+#define SYS_madvise 31
+#define SYS_mmap 32
@@ -503,3 +503,36 @@ sys_pipe(void)
   }
   return 0;
 }
+
+// map len bytes of an open file, from offset on, into
+// memory. the pages are read in as they are touched.
+uint64
+sys_mmap(void)
+{
+  struct file *f;
+  struct inode *ip;
+  int off, len, prot, flags;
+  uint size;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  argint(1, &off);
+  argint(2, &len);
+  argint(3, &prot);
+  argint(4, &flags);
+  if(f->type != FD_INODE || !f->readable || off < 0)
+    return -1;
+  // a shared mapping would have to write back to the file
+  if(flags != MAP_PRIVATE && (flags != MAP_SHARED || (prot & PROT_WRITE)))
+    return -1;
+
+  ip = f->ip;
+  ilock(ip);
+  size = ip->size;
+  if(ip->type != T_FILE){
+    iunlock(ip);
+    return -1;
+  }
+  iunlock(ip);
+  return kmmap(myproc(), ip, off, size, len, prot);
+}
@@ -7,6 +7,8 @@
 #include "proc.h"
 #include "vm.h"
 #include "memstat.h"
+#include "coremap.h"
+#include "vmtrace.h"
 
 uint64
 sys_exit(void)
@@ -111,10 +113,13 @@ static int get_page_state(struct proc *p, uint64 va) {
   va = PGROUNDDOWN(va);
   
   // For simplified implementation, check if page is actually mapped
-  pte_t *pte = walk(p->pagetable, va, 0);
+  pte_t *pte = walkleaf(p->pagetable, va, 0);
   if(pte && (*pte & PTE_V)) {
     return RESIDENT;
   }
+  if(pte && (*pte & PTE_S)) {
+    return SWAPPED;
+  }
   
   // Check if page is in valid memory range but not allocated
   if(va >= p->heap_start && va < p->sz) {
@@ -124,56 +129,212 @@ static int get_page_state(struct proc *p, uint64 va) {
   return UNMAPPED;
 }
 
+// The slot a swapped page is in, or that holds a clean copy
+// of a resident one
 static int get_page_swap_slot(struct proc *p, uint64 va) {
-  return -1; // Simplified implementation
+  pte_t *pte = walkleaf(p->pagetable, PGROUNDDOWN(va), 0);
+  if(pte && (*pte & PTE_S)) {
+    return PTE2SLOT(*pte);
+  }
+  if(pte && (*pte & PTE_V)) {
+    struct frame *f = pa2frame(PTE2PA(*pte));
+    return f ? f->slot : -1;
+  }
+  return -1;
+}
+
+static int get_page_dirty(struct proc *p, uint64 va) {
+  return page_is_dirty(p->pagetable, PGROUNDDOWN(va));
 }
 
-static int get_page_seq(struct proc *p, uint64 va) {
-  return -1; // Simplified implementation
+static int get_page_referenced(struct proc *p, uint64 va) {
+  pte_t *pte = walkleaf(p->pagetable, PGROUNDDOWN(va), 0);
+  return pte && (*pte & PTE_V) && (*pte & PTE_A);
 }
 
-static int get_page_dirty(struct proc *p, uint64 va) {
-  return 0; // Simplified implementation
+// How many of p's pages are out in swap
+static int count_swapped(struct proc *p) {
+  uint64 end = PGROUNDUP(p->sz);
+  int n = 0;
+  
+  for(uint64 va = uvmnext(p->pagetable, 0, end); va < end;
+      va = uvmnext(p->pagetable, va + PGSIZE, end))
+    if(get_page_state(p, va) == SWAPPED)
+      n++;
+  return n;
 }
 
+// report the caller's paging state, and up to n of its
+// resident or swapped pages from va on. Unmapped ranges are
+// skipped, so a large sparse process is cheap to page through.
+// Returns the number of pages reported.
 uint64
 sys_memstat(void)
 {
-  uint64 info_ptr;
+  uint64 info_ptr, pages_ptr, va;
+  int n;
   struct proc *p = myproc();
   
   argaddr(0, &info_ptr);
+  argaddr(1, &pages_ptr);
+  argint(2, &n);
+  argaddr(3, &va);
+  if(n < 0)
+    return -1;
   
   struct proc_mem_stat stat;
   stat.pid = p->pid;
   stat.num_resident_pages = p->num_resident;
-  stat.num_swapped_pages = p->num_swapped;
+  stat.resident_limit = p->rss_limit;
+  stat.num_swapped_pages = count_swapped(p);
   stat.next_fifo_seq = p->next_seq;
+  stat.policy = proc_policy(p);
+  stat.num_faults = p->num_faults;
+  stat.readahead_window = p->ra.window;
+  stat.readahead_hits = p->ra.hits;
+  stat.readahead_misses = p->ra.misses;
+  stat.num_pages_total = PGROUNDUP(p->sz) / PGSIZE;
   
-  // Calculate total pages
-  uint64 start_addr = 0;
-  uint64 end_addr = p->sz;
-  
-  stat.num_pages_total = (end_addr - start_addr) / PGSIZE;
-  if(stat.num_pages_total > MAX_PAGES_INFO) {
-    stat.num_pages_total = MAX_PAGES_INFO;
-  }
-  
-  // Fill page information
+  // Fill page information, one entry at a time
+  uint64 end = PGROUNDUP(p->sz);
   int page_count = 0;
-  for(uint64 va = start_addr; va < end_addr && page_count < MAX_PAGES_INFO; va += PGSIZE) {
-    struct page_stat *ps = &stat.pages[page_count];
-    ps->va = va;
-    ps->state = get_page_state(p, va);
-    ps->is_dirty = get_page_dirty(p, va);
-    ps->seq = get_page_seq(p, va);
-    ps->swap_slot = get_page_swap_slot(p, va);
+  va = uvmnext(p->pagetable, va, end);
+  while(va < end && page_count < n) {
+    struct page_stat ps;
+    ps.va = va;
+    ps.state = get_page_state(p, va);
+    ps.is_dirty = get_page_dirty(p, va);
+    ps.seq = get_page_seq(p, va);
+    ps.swap_slot = get_page_swap_slot(p, va);
+    ps.referenced = get_page_referenced(p, va);
+    ps.age = get_page_age(p, va);
+    if(copyout(p->pagetable, pages_ptr + page_count*sizeof(ps), (char*)&ps, sizeof(ps)) < 0)
+      return -1;
     page_count++;
+    va = uvmnext(p->pagetable, va + PGSIZE, end);
   }
+  stat.num_pages = page_count;
+  stat.next_va = va < end ? va : 0;
   
   // Copy to user space
   if(copyout(p->pagetable, info_ptr, (char*)&stat, sizeof(stat)) < 0)
     return -1;
     
+  return page_count;
+}
+
+// set the page-replacement policy of a process,
+// or of the whole system if pid is 0.
+uint64
+sys_setpolicy(void)
+{
+  int pid, policy;
+
+  argint(0, &pid);
+  argint(1, &policy);
+  return ksetpolicy(pid, policy);
+}
+
+// set how many extra pages a process maps
+// around each text/data page fault.
+uint64
+sys_setfaultaround(void)
+{
+  int pid, npages;
+
+  argint(0, &pid);
+  argint(1, &npages);
+  return ksetfaultaround(pid, npages);
+}
+
+// report free page counts per hart.
+uint64
+sys_kallocstat(void)
+{
+  uint64 addr;
+  struct kalloc_stat st;
+
+  argaddr(0, &addr);
+  kallocstat(&st);
+  if(copyout(myproc()->pagetable, addr, (char*)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
+// copy out up to n paging trace records, oldest first.
+uint64
+sys_vmtrace(void)
+{
+  uint64 addr;
+  int n;
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  if(n < 0)
+    return -1;
+  return vmtrace_read(addr, n);
+}
+
+// turn printing of paging events on the console on (1)
+// or off (0); returns the old setting. -1 just asks.
+uint64
+sys_vmverbose(void)
+{
+  int on, old = vmverbose;
+
+  argint(0, &on);
+  if(on >= 0)
+    vmverbose = (on != 0);
+  return old;
+}
+
+// report the system-wide paging counters.
+uint64
+sys_vmstat(void)
+{
+  uint64 addr;
+  struct vmstat st;
+
+  argaddr(0, &addr);
+  vmstat(&st);
+  if(copyout(myproc()->pagetable, addr, (char*)&st, sizeof(st)) < 0)
+    return -1;
   return 0;
 }
+
+// report how long page faults have taken to serve.
+uint64
+sys_faultlat(void)
+{
+  uint64 addr;
+
+  argaddr(0, &addr);
+  return vmlatency_read(addr);
+}
+
+// set the free-frame watermarks kswapd works between,
+// and how many pages reclaim evicts at once.
+uint64
+sys_setwatermarks(void)
+{
+  int low, high, batch;
+
+  argint(0, &low);
+  argint(1, &high);
+  argint(2, &batch);
+  return ksetwatermarks(low, high, batch);
+}
+
+// give the pager a hint about how a range of
+// memory will be used (MADV_*).
+uint64
+sys_madvise(void)
+{
+  uint64 addr;
+  int len, advice;
+
+  argaddr(0, &addr);
+  argint(1, &len);
+  argint(2, &advice);
+  return kmadvise(myproc(), addr, len, advice);
+}
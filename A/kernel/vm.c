@@ -17,6 +17,8 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+static void megasplit(pte_t*);
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
@@ -94,6 +96,9 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// A megapage in the way is split into ordinary pages, so
+// the caller always gets a level-0 PTE.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
 {
@@ -102,18 +107,59 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
 
   for(int level = 2; level > 0; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
+    if((*pte & PTE_V) && PTE_LEAF(*pte))
+      megasplit(pte);
     if(*pte & PTE_V) {
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
   return &pagetable[PX(0, va)];
 }
 
+// Replace the level-1 PTE of a megapage with a level-0 page
+// table mapping the same memory as 512 ordinary pages.
+static void
+megasplit(pte_t *pte)
+{
+  uint64 pa = PTE2PA(*pte);
+  int flags = PTE_FLAGS(*pte);
+  pagetable_t pt = (pagetable_t)kmega_split((void*)pa);
+
+  for(int i = 0; i < 512; i++)
+    pt[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  *pte = PA2PTE(pt) | PTE_V;
+}
+
+// Like walk(pagetable, va, 0), but a megapage is left whole:
+// the PTE returned is then its level-1 PTE, and *mega is set.
+pte_t *
+walkleaf(pagetable_t pagetable, uint64 va, int *mega)
+{
+  pte_t *pte;
+
+  if(va >= MAXVA)
+    panic("walkleaf");
+
+  if(mega)
+    *mega = 0;
+  for(int level = 2; level > 0; level--) {
+    pte = &pagetable[PX(level, va)];
+    if((*pte & PTE_V) == 0)
+      return 0;
+    if(PTE_LEAF(*pte)) {
+      if(mega)
+        *mega = 1;
+      return pte;
+    }
+    pagetable = (pagetable_t)PTE2PA(*pte);
+  }
+  return &pagetable[PX(0, va)];
+}
+
 // Look up a virtual address, return the physical address,
 // or 0 if not mapped.
 // Can only be used to look up user pages.
@@ -122,11 +168,12 @@ walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
   uint64 pa;
+  int mega;
 
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
+  pte = walkleaf(pagetable, va, &mega);
   if(pte == 0)
     return 0;
   if((*pte & PTE_V) == 0)
@@ -134,9 +181,43 @@ walkaddr(pagetable_t pagetable, uint64 va)
   if((*pte & PTE_U) == 0)
     return 0;
   pa = PTE2PA(*pte);
+  if(mega)
+    pa += MEGAOFF(va);
   return pa;
 }
 
+// Return the first page-aligned address in [va, end) at which
+// pagetable holds a page, resident or swapped out, or end if there
+// is none. Ranges with no page-table page are skipped whole.
+uint64
+uvmnext(pagetable_t pagetable, uint64 va, uint64 end)
+{
+  int level;
+
+  va = PGROUNDDOWN(va);
+  while(va < end && va < MAXVA){
+    pagetable_t pt = pagetable;
+    for(level = 2; level > 0; level--){
+      pte_t pte = pt[PX(level, va)];
+      if((pte & PTE_V) == 0)
+        break;
+      if(PTE_LEAF(pte))
+        return va;  // a megapage
+      pt = (pagetable_t)PTE2PA(pte);
+    }
+    if(level > 0){
+      // nothing mapped in this level's whole range
+      uint64 size = 1L << PXSHIFT(level);
+      va = (va + size) & ~(size - 1);
+      continue;
+    }
+    if(pt[PX(0, va)] & (PTE_V | PTE_S))
+      return va;
+    va += PGSIZE;
+  }
+  return end;
+}
+
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa.
 // va and size MUST be page-aligned.
@@ -173,22 +254,60 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   return 0;
 }
 
+// Map the megapage at pa at va, which must be 2 MiB aligned,
+// with a leaf PTE in a level-1 page table. Returns -1 if a
+// page-table page couldn't be allocated, or if the range holds
+// any page already, resident or swapped out.
+int
+mapmega(pagetable_t pagetable, uint64 va, uint64 pa, int perm)
+{
+  pte_t *pte;
+  pagetable_t pt;
+
+  if((va % MEGAPGSIZE) != 0 || (pa % MEGAPGSIZE) != 0)
+    panic("mapmega: not aligned");
+
+  pte = &pagetable[PX(2, va)];
+  if(*pte & PTE_V) {
+    pt = (pagetable_t)PTE2PA(*pte);
+  } else {
+    if((pt = (pagetable_t)kalloc_zeroed()) == 0)
+      return -1;
+    *pte = PA2PTE(pt) | PTE_V;
+  }
+
+  pte = &pt[PX(1, va)];
+  if(*pte & PTE_V) {
+    if(PTE_LEAF(*pte))
+      return -1;
+    // a level-0 page table: it must be empty, and goes
+    pt = (pagetable_t)PTE2PA(*pte);
+    for(int i = 0; i < 512; i++)
+      if(pt[i])
+        return -1;
+    *pte = 0;
+    kfree(pt);
+  }
+  *pte = PA2PTE(pa) | perm | PTE_V;
+  return 0;
+}
+
 // create an empty user page table.
 // returns 0 if out of memory.
 pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
 // Remove npages of mappings starting from va. va must be
 // page-aligned. It's OK if the mappings don't exist.
-// Optionally free the physical memory.
+// Optionally free the physical memory, or the swap slot
+// of a swapped-out page.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
@@ -199,15 +318,35 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
     panic("uvmunmap: not aligned");
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0) // leaf page table entry allocated?
+    int mega;
+    if((pte = walkleaf(pagetable, a, &mega)) == 0) // leaf page table entry allocated?
       continue;   
-    if((*pte & PTE_V) == 0)  // has physical page been allocated?
+    if(mega){
+      if(a % MEGAPGSIZE == 0 && a + MEGAPGSIZE <= va + npages*PGSIZE){
+        // all of a megapage goes
+        uint64 pa = PTE2PA(*pte);
+        *pte = 0;
+        if(do_free)
+          kfree_mega((void*)pa);
+        a += MEGAPGSIZE - PGSIZE;
+        continue;
+      }
+      pte = walk(pagetable, a, 0);  // split it: only part goes
+    }
+    if(*pte & PTE_S){  // page is out in swap
+      if(do_free)
+        swap_free_slot(PTE2SLOT(*pte));
+      *pte = 0;
       continue;
-    if(do_free){
-      uint64 pa = PTE2PA(*pte);
-      kfree((void*)pa);
     }
+    if((*pte & PTE_V) == 0)  // has physical page been allocated?
+      continue;
+    // clear the PTE before freeing the page: global replacement
+    // must not find the page through the PTE once it is free.
+    uint64 pa = PTE2PA(*pte);
     *pte = 0;
+    if(do_free)
+      kfree((void*)pa);
   }
 }
 
@@ -224,12 +363,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -289,31 +427,72 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Resident pages are shared copy-on-write:
+// both page tables map them without PTE_W,
+// and the first store makes a private copy.
+// Swapped-out pages share their swap slot with
+// the child. A megapage is copied into one
+// of its own if there is one to spare, or
+// else split and shared page by page.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
-  pte_t *pte;
+  pte_t *pte, *npte;
   uint64 pa, i;
   uint flags;
   char *mem;
+  int slot;
 
   for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
+    int mega;
+    if((pte = walkleaf(old, i, &mega)) == 0)
       continue;   // page table entry hasn't been allocated
-    if((*pte & PTE_V) == 0)
-      continue;   // physical page hasn't been allocated
-    pa = PTE2PA(*pte);
-    flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
-      goto err;
+    if(mega && (mem = kalloc_mega()) != 0){
+      char *split = kalloc();
+      if(split == 0 || mapmega(new, i, (uint64)mem, PTE_FLAGS(*pte)) != 0){
+        if(split)
+          kfree(split);
+        kfree_mega(mem);
+        goto err;
+      }
+      kmega_setsplit(mem, split);
+      memmove(mem, (char*)PTE2PA(*pte), MEGAPGSIZE);
+      i += MEGAPGSIZE - PGSIZE;
+      continue;
+    }
+    if(mega)
+      pte = walk(old, i, 0);  // split it, and share it page by page
+    // stay on the CPU while looking at the page, so that
+    // global replacement can't take it from under us.
+    push_off();
+    if(*pte & PTE_V){
+      pa = PTE2PA(*pte);
+      // the parent's swap slot can't stand in for two pages.
+      if((slot = frame_take_slot(pa)) >= 0){
+        swap_free_slot(slot);
+        *pte |= PTE_D;
+      }
+      *pte &= ~PTE_W;
+      flags = PTE_FLAGS(*pte);
+      kdup((void*)pa);
+      pop_off();
+      if(mappages(new, i, PGSIZE, pa, flags) != 0){
+        kfree((void*)pa);
+        goto err;
+      }
+    } else if(*pte & PTE_S){
+      // the child reads the page in from the same
+      // slot when it first touches it.
+      pte_t entry = *pte;
+      pop_off();
+      if((npte = walk(new, i, 1)) == 0)
+        goto err;
+      swap_dup(PTE2SLOT(entry));
+      *npte = entry;
+    } else {
+      pop_off();  // physical page hasn't been allocated
     }
   }
   return 0;
@@ -362,16 +541,37 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
       }
     }
 
-    pte = walk(pagetable, va0, 0);
+    // Don't give up the CPU between looking up the page and
+    // copying: global replacement takes pages from processes
+    // that aren't running. Start over if it got this one.
+    push_off();
+    if((pa0 = walkaddr(pagetable, va0)) == 0){
+      pop_off();
+      continue;
+    }
+
+    pte = walkleaf(pagetable, va0, 0);
     // forbid copyout over read-only user text pages.
     // printf("DEBUG: copyout check pte=0x%lx, PTE_W=%d\n", *pte, (*pte & PTE_W) != 0);
-    if((*pte & PTE_W) == 0)
-      return -1;
+    if((*pte & PTE_W) == 0){
+      // a page shared copy-on-write gets copied, as it would
+      // on a store from user space; text is off limits.
+      pop_off();
+      struct proc *p = myproc();
+      if(p == 0 || !may_write(p, va0) ||
+         demand_page_fault_with_pagetable(p, pagetable, va0, 1, 0) == 0)
+        return -1;
+      continue;
+    }
+    // the MMU doesn't see this write; keep a modified
+    // executable page from being discarded on eviction.
+    *pte |= PTE_D;
       
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
     memmove((void *)(pa0 + (dstva - va0)), src, n);
+    pop_off();
 
     len -= n;
     src += n;
@@ -401,10 +601,17 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
         return -1;
       }
     }
+    // stay on the CPU until the copy is done (see copyout)
+    push_off();
+    if((pa0 = walkaddr(pagetable, va0)) == 0){
+      pop_off();
+      continue;
+    }
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
     memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+    pop_off();
 
     len -= n;
     dst += n;
@@ -426,8 +633,22 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
-      return -1;
+    if(pa0 == 0) {
+      // the string may sit in a lazy or swapped-out page
+      struct proc *p = myproc();
+      if(p && demand_page_fault(p, va0, 0, 0)) {
+        pa0 = walkaddr(pagetable, va0);
+      }
+      if(pa0 == 0) {
+        return -1;
+      }
+    }
+    // stay on the CPU until the copy is done (see copyout)
+    push_off();
+    if((pa0 = walkaddr(pagetable, va0)) == 0){
+      pop_off();
+      continue;
+    }
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
@@ -446,6 +667,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
       p++;
       dst++;
     }
+    pop_off();
 
     srcva = va0 + PGSIZE;
   }
@@ -472,10 +694,9 @@ vmfault(pagetable_t pagetable, uint64 va, int read)
   if(ismapped(pagetable, va)) {
     return 0;
   }
-  mem = (uint64) kalloc();
+  mem = (uint64) kalloc_zeroed();
   if(mem == 0)
     return 0;
-  memset((void *) mem, 0, PGSIZE);
   if (mappages(p->pagetable, va, PGSIZE, mem, PTE_W|PTE_U|PTE_R) != 0) {
     kfree((void *)mem);
     return 0;
@@ -486,7 +707,7 @@ vmfault(pagetable_t pagetable, uint64 va, int read)
 int
 ismapped(pagetable_t pagetable, uint64 va)
 {
-  pte_t *pte = walk(pagetable, va, 0);
+  pte_t *pte = walkleaf(pagetable, va, 0);
   if (pte == 0) {
     return 0;
   }
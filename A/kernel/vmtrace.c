@@ -0,0 +1,253 @@
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+#define VT_NAMES
+#include "vmtrace.h"
+
+// Paging event trace.
+//
+// The demand pager records what it does as fixed-size binary
+// records rather than console lines: printf() takes a global lock
+// and then waits on the UART a character at a time, which under
+// paging load costs more than the faults themselves. Each hart has
+// its own ring, which only that hart adds to, with interrupts off,
+// so recording an event takes no lock. vmtrace() takes records out
+// again, oldest first across all harts. A full ring drops new
+// events, counting them, until it has been read.
+//
+// In verbose mode (vmverbose(), or make VMVERBOSE=1) each event is
+// also printed on the console. Kills always are.
+//
+// Every event is counted too, in per-hart counters that vmstat()
+// adds up, and so is the time each fault took to serve.
+
+struct vmring {
+  struct vmtrace_rec rec[NVMTRACE];
+  uint head;   // next record to fill; changed only by its hart
+  uint tail;   // oldest record; changed only by vmtrace_read()
+  uint lost;   // events dropped while the ring was full
+};
+
+static struct vmring vmrings[NCPU];
+
+struct vmcount {
+  uint64 faults[NVTCAUSE];
+  uint64 events[NVTEVENT];
+  uint64 dirty_evicts;
+  uint64 lat[NFTYPE][NLATBUCKET];
+};
+
+static struct vmcount vmcounts[NCPU];
+static struct sleeplock vmreadlock;  // one reader at a time
+
+#ifdef VMVERBOSE
+int vmverbose = 1;
+#else
+int vmverbose = 0;
+#endif
+
+void
+vmtraceinit(void)
+{
+  initsleeplock(&vmreadlock, "vmtrace");
+}
+
+// Print an event the way the console log always has.
+static void
+vmprint(struct vmtrace_rec *e)
+{
+  char *name = vt_events[e->event];
+
+  switch(e->event){
+  case VT_PAGEFAULT:
+    printf("[pid %d] %s va=0x%lx access=%s cause=%s\n", e->pid, name, e->va,
+           vt_accesses[e->a], vt_causes[e->b]);
+    break;
+  case VT_RESIDENT:
+    printf("[pid %d] %s va=0x%lx seq=%d\n", e->pid, name, e->va, e->a);
+    break;
+  case VT_VICTIM:
+    printf("[pid %d] %s va=0x%lx seq=%d algo=%s\n", e->pid, name, e->va, e->a, vt_algos[e->b]);
+    break;
+  case VT_EVICT:
+    printf("[pid %d] %s va=0x%lx state=%s\n", e->pid, name, e->va, e->a ? "dirty" : "clean");
+    break;
+  case VT_SWAPOUT:
+    printf("[pid %d] %s va=0x%lx slot=%d%s\n", e->pid, name, e->va, e->a, e->b ? " clean" : "");
+    break;
+  case VT_SWAPIN:
+    printf("[pid %d] %s va=0x%lx slot=%d\n", e->pid, name, e->va, e->a);
+    break;
+  case VT_FAULTAROUND:
+  case VT_READAHEAD:
+    printf("[pid %d] %s va=0x%lx npages=%d\n", e->pid, name, e->va, e->a);
+    break;
+  case VT_SWAPFULL:
+  case VT_MEMFULL:
+    printf("[pid %d] %s\n", e->pid, name);
+    break;
+  case VT_KILL:
+    printf("[pid %d] %s %s va=0x%lx", e->pid, name, vt_kills[e->a], e->va);
+    if(e->a == VK_ACCESS)
+      printf(" access=%s", vt_accesses[e->b]);
+    else if(e->a == VK_BADCAUSE || e->a == VK_NOSEGMENT || e->a == VK_LOADFAIL)
+      printf(" cause=%s", vt_causes[e->b]);
+    else if(e->a == VK_SWAPIN)
+      printf(" slot=%d", e->b);
+    printf("\n");
+    break;
+  case VT_LOST:
+    printf("[cpu %d] %s %d events\n", e->cpu, name, e->a);
+    break;
+  default:
+    printf("[pid %d] %s va=0x%lx\n", e->pid, name, e->va);
+    break;
+  }
+}
+
+// Record a paging event on behalf of p.
+void
+vmlog(struct proc *p, int event, uint64 va, int a, int b)
+{
+  struct vmtrace_rec e;
+  struct vmring *r;
+  struct vmcount *c;
+
+  e.time = r_time();
+  e.va = va;
+  e.pid = p ? p->pid : 0;
+  e.event = event;
+  e.a = a;
+  e.b = b;
+
+  push_off();
+  e.cpu = cpuid();
+  c = &vmcounts[e.cpu];
+  c->events[event]++;
+  if(event == VT_PAGEFAULT)
+    c->faults[b]++;
+  else if(event == VT_EVICT && a)
+    c->dirty_evicts++;
+  r = &vmrings[e.cpu];
+  if(r->head - r->tail < NVMTRACE){
+    r->rec[r->head % NVMTRACE] = e;
+    // the record must be complete before a reader sees it
+    __sync_synchronize();
+    r->head++;
+  } else {
+    __sync_fetch_and_add(&r->lost, 1);
+  }
+  pop_off();
+
+  if(vmverbose || event == VT_KILL)
+    vmprint(&e);
+}
+
+// Copy up to n of the oldest records, from all harts, to user
+// address addr. Returns the number copied, or -1.
+int
+vmtrace_read(uint64 addr, int n)
+{
+  struct proc *p = myproc();
+  struct vmtrace_rec e;
+  struct vmring *r;
+  int i;
+
+  acquiresleep(&vmreadlock);
+  for(i = 0; i < n; i++){
+    // the ring whose oldest record is oldest
+    struct vmring *oldest = 0;
+    for(r = vmrings; r < &vmrings[NCPU]; r++){
+      if(r->head == r->tail)
+        continue;
+      __sync_synchronize();
+      if(oldest == 0 || r->rec[r->tail % NVMTRACE].time <
+                        oldest->rec[oldest->tail % NVMTRACE].time)
+        oldest = r;
+    }
+    if(oldest == 0){
+      // all read: report what could not be kept
+      for(r = vmrings; r < &vmrings[NCPU]; r++)
+        if(r->lost > 0)
+          break;
+      if(r == &vmrings[NCPU])
+        break;
+      e.time = r_time();
+      e.va = 0;
+      e.pid = 0;
+      e.cpu = r - vmrings;
+      e.event = VT_LOST;
+      e.a = __sync_lock_test_and_set(&r->lost, 0);
+      e.b = 0;
+    } else {
+      e = oldest->rec[oldest->tail % NVMTRACE];
+    }
+    if(copyout(p->pagetable, addr + i*sizeof(e), (char*)&e, sizeof(e)) < 0){
+      releasesleep(&vmreadlock);
+      return -1;
+    }
+    if(oldest){
+      __sync_synchronize();
+      oldest->tail++;
+    }
+  }
+  releasesleep(&vmreadlock);
+  return i;
+}
+
+// Add up the paging counters of all harts. They are read
+// without locks, so a total may miss an event in progress.
+void
+vmstat(struct vmstat *st)
+{
+  memset(st, 0, sizeof(*st));
+  for(struct vmcount *c = vmcounts; c < &vmcounts[NCPU]; c++){
+    for(int i = 0; i < NVTCAUSE; i++)
+      st->faults[i] += c->faults[i];
+    for(int i = 0; i < NVTEVENT; i++)
+      st->events[i] += c->events[i];
+    st->dirty_evicts += c->dirty_evicts;
+  }
+  st->free_frames = kfreepages();
+  st->nframe = NFRAME;
+  swap_stat(st);
+  reclaim_stat(st);
+}
+
+// Count a fault of type (FT_*) that took dt ticks of the
+// time CSR to serve.
+void
+vmlatency(int type, uint64 dt)
+{
+  int b = 0;
+
+  while(b < NLATBUCKET-1 && (dt >> (b+1)) != 0)
+    b++;
+  push_off();
+  vmcounts[cpuid()].lat[type][b]++;
+  pop_off();
+}
+
+// Copy the fault latency histograms, summed over all harts,
+// to the struct faultlat at user address addr.
+int
+vmlatency_read(uint64 addr)
+{
+  uint64 row[NLATBUCKET];
+  struct proc *p = myproc();
+
+  for(int t = 0; t < NFTYPE; t++){
+    memset(row, 0, sizeof(row));
+    for(struct vmcount *c = vmcounts; c < &vmcounts[NCPU]; c++)
+      for(int b = 0; b < NLATBUCKET; b++)
+        row[b] += c->lat[t][b];
+    if(copyout(p->pagetable, addr + t*sizeof(row), (char*)row, sizeof(row)) < 0)
+      return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,156 @@
+#ifndef VMTRACE_H
+#define VMTRACE_H
+
+// Paging events, as recorded by the kernel and read with vmtrace().
+// a and b depend on the event.
+#define VT_PAGEFAULT    1  // a: access, b: cause
+#define VT_ALLOC        2  // zero-filled heap or stack page
+#define VT_LOADEXEC     3  // page read from the executable or a mapped file
+#define VT_LOADCACHED   4  // text page shared from the page cache
+#define VT_COW          5  // copy of a page shared since fork
+#define VT_COWREUSE     6  // shared page back to one user
+#define VT_DIRTY        7  // first store to a page
+#define VT_RESIDENT     8  // a: sequence number
+#define VT_VICTIM       9  // a: sequence number, b: policy
+#define VT_EVICT       10  // a: 1 if dirty
+#define VT_SWAPOUT     11  // a: slot, b: 1 if already there (clean)
+#define VT_DISCARD     12  // clean page dropped
+#define VT_SWAPFULL    13
+#define VT_SWAPIN      14  // a: slot
+#define VT_MEMFULL     15
+#define VT_FAULTAROUND 16  // a: pages mapped from va on
+#define VT_KILL        17  // a: reason (VK_*), b: as below
+#define VT_LOST        18  // a: events dropped by a full ring
+#define VT_MEGAPAGE    19  // 2 MiB zero-filled heap page at va
+#define VT_READAHEAD   20  // a: pages read in from va on with a swap-in
+#define NVTEVENT       21
+
+// Access (VT_PAGEFAULT a, VK_ACCESS b)
+#define VT_READ  0
+#define VT_WRITE 1
+#define VT_EXEC  2
+
+// Fault causes (VT_PAGEFAULT b)
+#define VT_TEXT    0
+#define VT_DATA    1
+#define VT_HEAP    2
+#define VT_STACK   3
+#define VT_SWAP    4
+#define VT_MMAP    5
+#define VT_INVALID 6
+#define NVTCAUSE   7
+
+// Why a fault killed the process (VT_KILL a)
+#define VK_ACCESS    0  // invalid-access; b: access
+#define VK_BADCAUSE  1  // invalid-access; b: cause
+#define VK_NOSEGMENT 2  // b: cause
+#define VK_LOADFAIL  3  // b: cause
+#define VK_NOVICTIM  4
+#define VK_SWAPOUT   5
+#define VK_SWAPIN    6  // b: slot
+#define VK_MAPFAIL   7
+#define NVKREASON    8
+
+// System-wide paging counters (vmstat)
+struct vmstat {
+  uint64 faults[NVTCAUSE];   // page faults by cause
+  uint64 events[NVTEVENT];   // paging events by type
+  uint64 dirty_evicts;       // of events[VT_EVICT], dirty pages
+  int free_frames;           // pages kalloc() can give out
+  int nframe;                // pages kalloc() manages
+  int swap_used;             // swap slots in use
+  int swap_slots;            // slots in the swap area
+  int free_low;              // kswapd wakes below this many free frames
+  int free_high;             // and evicts until this many are free
+  int evict_batch;           // pages evicted at once when memory is full
+  uint64 kswapd_wakeups;     // times kswapd has been woken
+  uint64 kswapd_pages;       // frames it has freed
+  int zswap_frames;          // frames in the compressed swap cache
+  int zswap_pages;           // swapped pages held there
+  int zswap_same;            // of them, one value repeated (no frame space)
+  uint64 zswap_bytes;        // compressed size of those pages
+  uint64 zswap_stores;       // pages put in the cache
+  uint64 zswap_loads;        // swap-ins served from it, with no disk read
+  uint64 zswap_rejects;      // pages that would not compress, written to disk
+  uint64 zswap_writebacks;   // pages moved from it to disk to make room
+};
+
+// Fault service-time histograms (faultlat): how many faults of
+// each type took between 2^i and 2^(i+1) ticks of the time CSR
+// (100ns on qemu) to serve. The last bucket takes all longer ones.
+#define FT_ZERO    0  // zero-filled heap or stack page
+#define FT_EXEC    1  // page read from the executable
+#define FT_SWAPIN  2  // page read back from swap
+#define FT_EVICT   3  // any of those that first evicted a page
+#define FT_OTHER   4  // copy-on-write, dirty bit, cached text, ...
+#define NFTYPE     5
+#define NLATBUCKET 24
+
+struct faultlat {
+  uint64 hist[NFTYPE][NLATBUCKET];
+};
+
+struct vmtrace_rec {
+  uint64 time;   // time CSR when recorded
+  uint64 va;
+  int pid;
+  short cpu;
+  short event;   // VT_*
+  int a;
+  int b;
+};
+
+#ifdef VT_NAMES
+// Names for printing records, shared by the kernel's console log
+// and the vmtrace program. Define VT_NAMES before including this
+// file to get them.
+static char *vt_events[NVTEVENT] = {
+[VT_PAGEFAULT]   "PAGEFAULT",
+[VT_ALLOC]       "ALLOC",
+[VT_LOADEXEC]    "LOADEXEC",
+[VT_LOADCACHED]  "LOADEXEC-CACHED",
+[VT_COW]         "COW",
+[VT_COWREUSE]    "COW-REUSE",
+[VT_DIRTY]       "DIRTY",
+[VT_RESIDENT]    "RESIDENT",
+[VT_VICTIM]      "VICTIM",
+[VT_EVICT]       "EVICT",
+[VT_SWAPOUT]     "SWAPOUT",
+[VT_DISCARD]     "DISCARD",
+[VT_SWAPFULL]    "SWAPFULL",
+[VT_SWAPIN]      "SWAPIN",
+[VT_MEMFULL]     "MEMFULL",
+[VT_FAULTAROUND] "FAULTAROUND",
+[VT_KILL]        "KILL",
+[VT_LOST]        "LOST",
+[VT_MEGAPAGE]    "MEGAPAGE",
+[VT_READAHEAD]   "READAHEAD",
+};
+
+static char *vt_accesses[] = { "read", "write", "exec" };
+
+static char *vt_causes[NVTCAUSE] = {
+[VT_TEXT]    "text",
+[VT_DATA]    "data",
+[VT_HEAP]    "heap",
+[VT_STACK]   "stack",
+[VT_SWAP]    "swap",
+[VT_MMAP]    "mmap",
+[VT_INVALID] "invalid",
+};
+
+static char *vt_kills[NVKREASON] = {
+[VK_ACCESS]    "invalid-access",
+[VK_BADCAUSE]  "invalid-access",
+[VK_NOSEGMENT] "no-segment",
+[VK_LOADFAIL]  "load-failed",
+[VK_NOVICTIM]  "no-victim",
+[VK_SWAPOUT]   "swapout-failed",
+[VK_SWAPIN]    "swapin-failed",
+[VK_MAPFAIL]   "mapping-failed",
+};
+
+static char *vt_algos[] = { "FIFO", "CLOCK", "AGING" };
+#endif
+
+#endif
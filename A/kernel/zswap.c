@@ -0,0 +1,349 @@
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "defs.h"
+#include "vmtrace.h"
+
+// Compressed swap cache.
+//
+// A page on its way to a swap slot is offered here first. One that
+// is a single 64-bit value over and over (most often all zeros) is
+// kept as just that value. Any other is compressed with a small
+// LZ77 coder and kept if it shrinks to ZMAXLEN bytes or less, in a
+// pool of ZPOOLPAGES frames set aside at boot and divided into
+// 64-byte chunks. A page kept here never goes to the disk unless
+// the pool fills: swap.c then writes the least recently used entry
+// out to its slot to make room. Entries are found by slot, and go
+// when the slot is freed.
+//
+// zs.lock guards the entries and the pool, and is held only to
+// install, look up or remove an entry: pages are compressed and
+// expanded outside it, in work areas of the hart's own, with
+// interrupts off so that nothing else on the hart can use them
+// meanwhile. swap.c may call in holding swap.lock, which comes
+// first.
+
+#define ZCHUNK     64                // bytes per pool chunk
+#define ZMAXLEN    (PGSIZE*3/4)      // largest compressed page kept
+#define NZENTRY    512               // pages the cache can hold
+#define MINMATCH   4
+#define MAXMATCH   (0x7f + MINMATCH)
+#define ZHASHBITS  10
+
+struct zentry {
+  int slot;           // -1 if the entry is free
+  short page;         // pool page, or -1 if same-filled
+  uchar chunk;        // first chunk in the page
+  uchar nchunk;
+  ushort len;         // compressed bytes
+  uint64 fill;        // the value of a same-filled page
+  short prev, next;   // LRU list, most recent first; free list
+};
+
+struct {
+  struct spinlock lock;
+  int npages;                    // frames in the pool
+  char *pages[ZPOOLPAGES];
+  uint64 used[ZPOOLPAGES];       // chunks in use, a bit each
+  struct zentry e[NZENTRY];
+  short head, tail;              // LRU list, -1 if empty
+  short free;                    // free entries
+  short index[MAXSWAPSLOT];      // entry holding each slot, plus 1
+  int nstored;                   // pages held
+  int nsame;                     // of them, same-filled
+  uint64 bytes;                  // compressed bytes held
+  uint64 stores, loads, rejects, writebacks;
+} zs;
+
+// Each hart's work areas
+struct zwork {
+  ushort hash[1 << ZHASHBITS];  // coder's recent positions
+  uchar buf[ZMAXLEN];           // a compressed page
+};
+
+static struct zwork zwork[NCPU];
+
+void zswapinit(void) {
+  initlock(&zs.lock, "zswap");
+  for(int i = 0; i < NZENTRY; i++) {
+    zs.e[i].slot = -1;
+    zs.e[i].next = i + 1 < NZENTRY ? i + 1 : -1;
+  }
+  zs.free = 0;
+  zs.head = zs.tail = -1;
+  for(zs.npages = 0; zs.npages < ZPOOLPAGES; zs.npages++)
+    if((zs.pages[zs.npages] = kalloc()) == 0)
+      break;
+}
+
+// Compress a page from src into dst, in at most max bytes. The
+// output is a series of literal runs (a byte n < 0x80, then n+1
+// bytes) and matches (a byte 0x80 | (length - MINMATCH), then a
+// two-byte distance back). Returns the length, or -1 if it won't fit.
+static int lz_compress(uchar *src, uchar *dst, int max, ushort *zhash) {
+  int ip = 0, op = 0, lit = 0;
+
+  memset(zhash, 0, sizeof(zwork[0].hash));
+  for(;;) {
+    int len = 0, ref = 0;
+    if(ip + MINMATCH <= PGSIZE) {
+      uint seq = src[ip] | src[ip+1] << 8 | src[ip+2] << 16 | (uint)src[ip+3] << 24;
+      uint h = (seq * 2654435761U) >> (32 - ZHASHBITS);
+      ref = zhash[h];
+      zhash[h] = ip;
+      if(ref < ip && memcmp(src + ref, src + ip, MINMATCH) == 0)
+        for(len = MINMATCH; ip + len < PGSIZE && len < MAXMATCH && src[ref+len] == src[ip+len]; len++)
+          ;
+    }
+    // flush literals before a match or at the end
+    if(len > 0 || ip >= PGSIZE) {
+      while(lit < ip) {
+        int n = ip - lit < 0x80 ? ip - lit : 0x80;
+        if(op + 1 + n > max)
+          return -1;
+        dst[op++] = n - 1;
+        memmove(dst + op, src + lit, n);
+        op += n;
+        lit += n;
+      }
+      if(ip >= PGSIZE)
+        return op;
+    }
+    if(len == 0) {
+      ip++;
+      continue;
+    }
+    if(op + 3 > max)
+      return -1;
+    dst[op++] = 0x80 | (len - MINMATCH);
+    dst[op++] = (ip - ref) & 0xff;
+    dst[op++] = (ip - ref) >> 8;
+    ip += len;
+    lit = ip;
+  }
+}
+
+// Expand n bytes from lz_compress() into the page dst.
+// Returns -1 if they don't make exactly a page.
+static int lz_decompress(uchar *src, int n, uchar *dst) {
+  int ip = 0, op = 0;
+
+  while(ip < n) {
+    int c = src[ip++];
+    if(c < 0x80) {
+      int len = c + 1;
+      if(ip + len > n || op + len > PGSIZE)
+        return -1;
+      memmove(dst + op, src + ip, len);
+      ip += len;
+      op += len;
+    } else {
+      int len = (c & 0x7f) + MINMATCH;
+      if(ip + 2 > n)
+        return -1;
+      int off = src[ip] | src[ip+1] << 8;
+      ip += 2;
+      if(off == 0 || off > op || op + len > PGSIZE)
+        return -1;
+      for(; len > 0; len--, op++)
+        dst[op] = dst[op - off];  // may overlap: byte by byte
+    }
+  }
+  return op == PGSIZE ? 0 : -1;
+}
+
+// If the page is one 64-bit value repeated, set *fill to it.
+static int same_filled(uint64 *page, uint64 *fill) {
+  for(int i = 1; i < PGSIZE / sizeof(uint64); i++)
+    if(page[i] != page[0])
+      return 0;
+  *fill = page[0];
+  return 1;
+}
+
+// Find n free chunks in a row; returns the pool page, or -1.
+static int chunk_alloc(int n, int *chunk) {
+  uint64 want = (1UL << n) - 1;
+
+  for(int pg = 0; pg < zs.npages; pg++)
+    for(int c = 0; c + n <= PGSIZE / ZCHUNK; c++)
+      if((zs.used[pg] & (want << c)) == 0) {
+        zs.used[pg] |= want << c;
+        *chunk = c;
+        return pg;
+      }
+  return -1;
+}
+
+static void lru_unlink(int i) {
+  struct zentry *e = &zs.e[i];
+
+  if(e->prev >= 0)
+    zs.e[e->prev].next = e->next;
+  else
+    zs.head = e->next;
+  if(e->next >= 0)
+    zs.e[e->next].prev = e->prev;
+  else
+    zs.tail = e->prev;
+}
+
+static void lru_push(int i) {
+  struct zentry *e = &zs.e[i];
+
+  e->prev = -1;
+  e->next = zs.head;
+  if(zs.head >= 0)
+    zs.e[zs.head].prev = i;
+  zs.head = i;
+  if(zs.tail < 0)
+    zs.tail = i;
+}
+
+// Free entry i and its chunks.
+static void entry_free(int i) {
+  struct zentry *e = &zs.e[i];
+
+  lru_unlink(i);
+  if(e->page >= 0)
+    zs.used[e->page] &= ~(((1UL << e->nchunk) - 1) << e->chunk);
+  else
+    zs.nsame--;
+  zs.nstored--;
+  zs.bytes -= e->len;
+  zs.index[e->slot] = 0;
+  e->slot = -1;
+  e->next = zs.free;
+  zs.free = i;
+}
+
+// Keep the page about to be written to slot. Returns 0 if it
+// has been, -1 if it doesn't compress, or -2 if there is no room
+// until an entry has been written back.
+int zswap_put(int slot, char *page) {
+  uint64 fill = 0;
+  int len = 0, pg = -1, chunk = 0, nchunk = 0, r = 0;
+
+  push_off();
+  struct zwork *w = &zwork[cpuid()];
+  if(!same_filled((uint64*)page, &fill)) {
+    len = lz_compress((uchar*)page, w->buf, ZMAXLEN, w->hash);
+    nchunk = (len + ZCHUNK - 1) / ZCHUNK;
+  }
+
+  acquire(&zs.lock);
+  if(zs.index[slot])
+    entry_free(zs.index[slot] - 1);  // an old copy
+  if(len < 0) {
+    zs.rejects++;
+    r = -1;
+  } else if(zs.free < 0 || (nchunk > 0 && (pg = chunk_alloc(nchunk, &chunk)) < 0)) {
+    r = -2;
+  } else {
+    if(nchunk > 0)
+      memmove(zs.pages[pg] + chunk*ZCHUNK, w->buf, len);
+    int i = zs.free;
+    struct zentry *e = &zs.e[i];
+    zs.free = e->next;
+    e->slot = slot;
+    e->page = pg;
+    e->chunk = chunk;
+    e->nchunk = nchunk;
+    e->len = len;
+    e->fill = fill;
+    lru_push(i);
+    zs.index[slot] = i + 1;
+    zs.nstored++;
+    if(pg < 0)
+      zs.nsame++;
+    zs.bytes += len;
+    zs.stores++;
+  }
+  release(&zs.lock);
+  pop_off();
+  return r;
+}
+
+// Copy the page kept for slot into page; touch moves it to
+// the front of the LRU list. Returns -1 if it isn't here.
+static int zswap_load(int slot, char *page, int touch) {
+  struct zentry e;
+  int i;
+
+  push_off();
+  struct zwork *w = &zwork[cpuid()];
+  acquire(&zs.lock);
+  if((i = zs.index[slot] - 1) < 0) {
+    release(&zs.lock);
+    pop_off();
+    return -1;
+  }
+  e = zs.e[i];
+  if(e.page >= 0)
+    memmove(w->buf, zs.pages[e.page] + e.chunk*ZCHUNK, e.len);
+  if(touch) {
+    lru_unlink(i);
+    lru_push(i);
+    zs.loads++;
+  }
+  release(&zs.lock);
+
+  if(e.page < 0) {
+    for(int j = 0; j < PGSIZE / sizeof(uint64); j++)
+      ((uint64*)page)[j] = e.fill;
+  } else if(lz_decompress(w->buf, e.len, (uchar*)page) < 0) {
+    panic("zswap: corrupt");
+  }
+  pop_off();
+  return 0;
+}
+
+// Copy the page kept for slot into page. Returns -1 if
+// slot's page isn't here but on the disk.
+int zswap_get(int slot, char *page) {
+  return zswap_load(slot, page, 1);
+}
+
+// Forget slot's page, which is no longer wanted.
+void zswap_drop(int slot) {
+  acquire(&zs.lock);
+  if(zs.index[slot])
+    entry_free(zs.index[slot] - 1);
+  release(&zs.lock);
+}
+
+// Make room: return the slot of the least recently used page,
+// or -1 if the cache is empty. The caller writes it out, from
+// zswap_copy(), and then drops it; one writer at a time.
+int zswap_oldest(void) {
+  int slot = -1;
+
+  acquire(&zs.lock);
+  if(zs.tail >= 0) {
+    slot = zs.e[zs.tail].slot;
+    zs.writebacks++;
+  }
+  release(&zs.lock);
+  return slot;
+}
+
+// Copy slot's page into page, as zswap_get() does, but
+// leave it where it is in the LRU list.
+int zswap_copy(int slot, char *page) {
+  return zswap_load(slot, page, 0);
+}
+
+void zswap_stat(struct vmstat *st) {
+  acquire(&zs.lock);
+  st->zswap_frames = zs.npages;
+  st->zswap_pages = zs.nstored;
+  st->zswap_same = zs.nsame;
+  st->zswap_bytes = zs.bytes;
+  st->zswap_stores = zs.stores;
+  st->zswap_loads = zs.loads;
+  st->zswap_rejects = zs.rejects;
+  st->zswap_writebacks = zs.writebacks;
+  release(&zs.lock);
+}
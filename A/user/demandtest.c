@@ -1,8 +1,862 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
+#include "kernel/memstat.h"
+#include "kernel/fcntl.h"
+#include "kernel/vmtrace.h"
 #include "user/user.h"
 
 #define PAGE_SIZE 4096
+#define MEGA_SIZE (2 * 1024 * 1024)
+
+// madvise(): dropped pages come back zero-filled, prefetched
+// ones are resident before they are touched, a sequential scan
+// larger than the resident set evicts the pages behind it and
+// reads back intact, and swapped pages in a random range come
+// back one at a time, with no readahead.
+static void advise_test(void)
+{
+    int n = 160, nr = 96;
+    char *heap = sbrklazy(n * PAGE_SIZE);
+    char *keep = heap + (n - 1) * PAGE_SIZE;
+    struct proc_mem_stat st;
+    struct page_stat ps[4];
+
+    if (setpolicy(getpid(), POLICY_FIFO) < 0) {
+        printf("demandtest: setpolicy failed\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < 4; i++)
+        heap[i * PAGE_SIZE] = 'D';
+    if (madvise(heap, 4 * PAGE_SIZE, MADV_DONTNEED) < 0) {
+        printf("demandtest: madvise DONTNEED failed\n");
+        exit(1);
+    }
+    for (int i = 0; i < 4; i++) {
+        if (heap[i * PAGE_SIZE] != 0) {
+            printf("demandtest: page %d kept its contents after DONTNEED\n", i);
+            exit(1);
+        }
+    }
+    printf("DONTNEED: pages dropped\n");
+
+    memstat(&st, 0, 0, 0);
+    int before = st.num_resident_pages;
+    if (madvise(heap + 8 * PAGE_SIZE, 4 * PAGE_SIZE, MADV_WILLNEED) < 0) {
+        printf("demandtest: madvise WILLNEED failed\n");
+        exit(1);
+    }
+    memstat(&st, ps, 4, (uint64)(heap + 8 * PAGE_SIZE));
+    for (int i = 0; i < 4; i++) {
+        if (i >= st.num_pages || ps[i].va != (uint64)(heap + (8 + i) * PAGE_SIZE) ||
+            ps[i].state != RESIDENT) {
+            printf("demandtest: page %d not resident after WILLNEED\n", 8 + i);
+            exit(1);
+        }
+    }
+    printf("WILLNEED: %d pages resident before, %d after\n",
+           before, st.num_resident_pages);
+
+    // keep is older than the scanned pages, so FIFO would evict
+    // it first; evict-behind takes the pages the scan has passed.
+    keep[0] = 'K';
+    if (madvise(heap, (n - 1) * PAGE_SIZE, MADV_SEQUENTIAL) < 0) {
+        printf("demandtest: madvise SEQUENTIAL failed\n");
+        exit(1);
+    }
+    for (int i = 0; i < n - 1; i++)
+        heap[i * PAGE_SIZE] = 'a' + (i % 26);
+    memstat(&st, ps, 1, (uint64)keep);
+    if (st.num_pages < 1 || ps[0].state != RESIDENT || st.num_swapped_pages == 0) {
+        printf("demandtest: SEQUENTIAL scan didn't evict behind itself\n");
+        exit(1);
+    }
+    for (int i = 0; i < n - 1; i++) {
+        if (heap[i * PAGE_SIZE] != 'a' + (i % 26)) {
+            printf("demandtest: page %d lost its contents\n", i);
+            exit(1);
+        }
+    }
+    printf("SEQUENTIAL: %d pages scanned, %d swapped behind the scan\n",
+           n - 1, st.num_swapped_pages);
+
+    char *rnd = sbrklazy(nr * PAGE_SIZE);
+    if (madvise(rnd, nr * PAGE_SIZE, MADV_RANDOM) < 0) {
+        printf("demandtest: madvise RANDOM failed\n");
+        exit(1);
+    }
+    for (int i = 0; i < nr; i++)
+        rnd[i * PAGE_SIZE] = 'A' + (i % 26);
+    uint64 end = (uint64)(rnd + nr * PAGE_SIZE);
+    int swapped = 0;
+    for (uint64 va = (uint64)rnd; va != 0 && va < end; va = st.next_va) {
+        int got = memstat(&st, ps, 4, va);
+        for (int i = 0; i < got; i++)
+            if (ps[i].va < end && ps[i].state == SWAPPED)
+                swapped++;
+    }
+    memstat(&st, 0, 0, 0);
+    int faults = st.num_faults;
+    for (int i = 0; i < nr; i++) {
+        if (rnd[i * PAGE_SIZE] != 'A' + (i % 26)) {
+            printf("demandtest: random page %d lost its contents\n", i);
+            exit(1);
+        }
+    }
+    memstat(&st, 0, 0, 0);
+    faults = st.num_faults - faults;
+    if (swapped == 0 || faults < swapped) {
+        printf("demandtest: RANDOM range read %d swapped pages back in %d faults\n",
+               swapped, faults);
+        exit(1);
+    }
+    printf("RANDOM: %d swapped pages read back in %d faults\n", swapped, faults);
+
+    if (madvise(heap + 1, PAGE_SIZE, MADV_RANDOM) == 0 ||
+        madvise(heap, PAGE_SIZE, 99) == 0) {
+        printf("demandtest: madvise accepted bad arguments\n");
+        exit(1);
+    }
+}
+
+// mmap(): a file's pages come in on demand, a private mapping
+// keeps its writes to itself, and a read-only one can't be written.
+static void mmap_test(void)
+{
+    int n = 6;
+    char buf[PAGE_SIZE];
+    int fd = open("mmapfile", O_CREATE | O_RDWR);
+
+    if (fd < 0) {
+        printf("demandtest: can't create mmapfile\n");
+        exit(1);
+    }
+    for (int i = 0; i < n; i++) {
+        memset(buf, 'a' + i, PAGE_SIZE);
+        if (write(fd, buf, PAGE_SIZE) != PAGE_SIZE) {
+            printf("demandtest: write failed\n");
+            exit(1);
+        }
+    }
+
+    char *ro = mmap(fd, PAGE_SIZE, (n - 1) * PAGE_SIZE, PROT_READ, MAP_SHARED);
+    char *rw = mmap(fd, 0, n * PAGE_SIZE + 100, PROT_READ | PROT_WRITE, MAP_PRIVATE);
+    if (ro == (char*)-1 || rw == (char*)-1) {
+        printf("demandtest: mmap failed\n");
+        exit(1);
+    }
+    if (mmap(fd, 0, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED) != (char*)-1 ||
+        mmap(fd, 1, PAGE_SIZE, PROT_READ, MAP_PRIVATE) != (char*)-1) {
+        printf("demandtest: mmap accepted bad arguments\n");
+        exit(1);
+    }
+    close(fd);  // the mappings keep the file
+
+    for (int i = 0; i < n - 1; i++) {
+        if (ro[i * PAGE_SIZE] != 'b' + i || ro[i * PAGE_SIZE + PAGE_SIZE - 1] != 'b' + i) {
+            printf("demandtest: read-only page %d wrong\n", i);
+            exit(1);
+        }
+    }
+    printf("mmap: read %d pages\n", n - 1);
+
+    for (int i = 0; i < n; i++)
+        rw[i * PAGE_SIZE] = 'X';
+    if (rw[n * PAGE_SIZE] != 0) {
+        printf("demandtest: page past the end of the file not zero\n");
+        exit(1);
+    }
+    if (ro[0] != 'b') {
+        printf("demandtest: private write reached another mapping\n");
+        exit(1);
+    }
+    fd = open("mmapfile", O_RDONLY);
+    if (read(fd, buf, PAGE_SIZE) != PAGE_SIZE || buf[0] != 'a') {
+        printf("demandtest: private write reached the file\n");
+        exit(1);
+    }
+    close(fd);
+    printf("mmap: private writes kept private\n");
+
+    // A shared mapping isn't coherent with write(): a page already
+    // faulted in keeps its contents, one faulted in later sees the
+    // file as it is then. RANDOM keeps fault-around off page 1.
+    fd = open("mmapfile", O_RDWR);
+    char *sh = mmap(fd, 0, 2 * PAGE_SIZE, PROT_READ, MAP_SHARED);
+    if (sh == (char*)-1 || madvise(sh, 2 * PAGE_SIZE, MADV_RANDOM) < 0) {
+        printf("demandtest: shared mmap failed\n");
+        exit(1);
+    }
+    if (sh[0] != 'a') {
+        printf("demandtest: shared page 0 wrong\n");
+        exit(1);
+    }
+    memset(buf, 'Z', PAGE_SIZE);
+    if (write(fd, buf, PAGE_SIZE) != PAGE_SIZE || write(fd, buf, PAGE_SIZE) != PAGE_SIZE) {
+        printf("demandtest: write failed\n");
+        exit(1);
+    }
+    close(fd);
+    if (sh[PAGE_SIZE] != 'Z') {
+        printf("demandtest: page faulted in after write() missed it\n");
+        exit(1);
+    }
+    if (sh[0] != 'a') {
+        printf("demandtest: page faulted in before write() changed\n");
+        exit(1);
+    }
+    unlink("mmapfile");
+    printf("mmap: shared pages see write() from their next fault\n");
+
+    int pid = fork();
+    if (pid == 0) {
+        ro[0] = 'Y';  // should kill the child
+        exit(0);
+    }
+    int status;
+    wait(&status);
+    if (status != -1) {
+        printf("demandtest: store to a read-only mapping allowed\n");
+        exit(1);
+    }
+    printf("mmap: store to read-only mapping killed\n");
+}
+
+// Map n pages of fd and read them in order, with fault-around set
+// to window and advice on the range. Returns the faults it took,
+// and sets *around to the fault-around passes.
+static int scan_mapped(int fd, int n, int window, int advice, uint64 *around)
+{
+    struct vmstat before, vs;
+    char *m = mmap(fd, 0, n * PAGE_SIZE, PROT_READ, MAP_PRIVATE);
+
+    if (m == (char*)-1 || setfaultaround(getpid(), window) < 0 ||
+        (advice != MADV_NORMAL && madvise(m, n * PAGE_SIZE, advice) < 0)) {
+        printf("demandtest: can't set up the scan\n");
+        exit(1);
+    }
+    vmstat(&before);
+    for (int i = 0; i < n; i++) {
+        if (m[i * PAGE_SIZE] != 'A' + i % 26) {
+            printf("demandtest: mapped page %d wrong\n", i);
+            exit(1);
+        }
+    }
+    vmstat(&vs);
+    *around = vs.events[VT_FAULTAROUND] - before.events[VT_FAULTAROUND];
+    return vs.faults[VT_MMAP] - before.faults[VT_MMAP];
+}
+
+// Fault-around: a sequential scan of a mapped file takes a fault
+// per page with the window at 0, far fewer with a wider window,
+// and a fault per page again in a RANDOM range.
+static void faultaround_test(void)
+{
+    int n = 32, window = 8;
+    char buf[PAGE_SIZE];
+    uint64 around0, around, around_random;
+    int fd = open("fafile", O_CREATE | O_RDWR);
+
+    for (int i = 0; i < n; i++) {
+        memset(buf, 'A' + i % 26, PAGE_SIZE);
+        if (write(fd, buf, PAGE_SIZE) != PAGE_SIZE) {
+            printf("demandtest: write failed\n");
+            exit(1);
+        }
+    }
+    int faults0 = scan_mapped(fd, n, 0, MADV_NORMAL, &around0);
+    int faults = scan_mapped(fd, n, window, MADV_NORMAL, &around);
+    int faults_random = scan_mapped(fd, n, window, MADV_RANDOM, &around_random);
+    close(fd);
+    unlink("fafile");
+
+    printf("faultaround: window 0: %d faults; window %d: %d faults, %d passes; RANDOM: %d faults\n",
+           faults0, window, faults, (int)around, faults_random);
+    if (faults0 != n || around0 != 0) {
+        printf("demandtest: fault-around with window 0\n");
+        exit(1);
+    }
+    if (faults >= faults0 || around == 0) {
+        printf("demandtest: window %d saved no faults\n", window);
+        exit(1);
+    }
+    if (faults_random != n || around_random != 0) {
+        printf("demandtest: fault-around in a RANDOM range\n");
+        exit(1);
+    }
+}
+
+// fork() shares pages copy-on-write: a store by either side,
+// parent or child, makes a private copy the other never sees.
+static void cow_test(void)
+{
+    int n = 8, fds[2];
+    char c;
+    char *heap = sbrklazy(n * PAGE_SIZE);
+
+    for (int i = 0; i < n; i++)
+        heap[i * PAGE_SIZE] = 'A' + i;
+    if (pipe(fds) < 0) {
+        printf("demandtest: pipe failed\n");
+        exit(1);
+    }
+    int pid = fork();
+    if (pid < 0) {
+        printf("demandtest: fork failed\n");
+        exit(1);
+    }
+    if (pid == 0) {
+        read(fds[0], &c, 1);  // the parent has written its pages
+        for (int i = 0; i < n; i += 2)
+            heap[i * PAGE_SIZE] = 'a' + i;
+        for (int i = 0; i < n; i++) {
+            char want = i % 2 == 0 ? 'a' + i : 'A' + i;
+            if (heap[i * PAGE_SIZE] != want) {
+                printf("demandtest: child sees %c in page %d, not %c\n",
+                       heap[i * PAGE_SIZE], i, want);
+                exit(1);
+            }
+        }
+        exit(0);
+    }
+    for (int i = 1; i < n; i += 2)
+        heap[i * PAGE_SIZE] = '0' + i;
+    write(fds[1], "x", 1);
+    int status;
+    wait(&status);
+    if (status != 0) {
+        printf("demandtest: cow child failed\n");
+        exit(1);
+    }
+    for (int i = 0; i < n; i++) {
+        char want = i % 2 == 1 ? '0' + i : 'A' + i;
+        if (heap[i * PAGE_SIZE] != want) {
+            printf("demandtest: parent sees %c in page %d, not %c\n",
+                   heap[i * PAGE_SIZE], i, want);
+            exit(1);
+        }
+    }
+    close(fds[0]);
+    close(fds[1]);
+    printf("cow: parent and child writes kept apart\n");
+}
+
+// Start cat with its input and output on pipes, and return once
+// it has echoed a byte back, so its text is in; closing *in ends it.
+static int start_cat(int *in)
+{
+    int to[2], from[2];
+    char c;
+    char *argv[] = { "cat", 0 };
+
+    if (pipe(to) < 0 || pipe(from) < 0) {
+        printf("demandtest: pipe failed\n");
+        exit(1);
+    }
+    int pid = fork();
+    if (pid < 0) {
+        printf("demandtest: fork failed\n");
+        exit(1);
+    }
+    if (pid == 0) {
+        close(0);
+        dup(to[0]);
+        close(1);
+        dup(from[1]);
+        close(to[0]);
+        close(to[1]);
+        close(from[0]);
+        close(from[1]);
+        exec("cat", argv);
+        exit(1);
+    }
+    close(to[0]);
+    close(from[1]);
+    if (write(to[1], "x", 1) != 1 || read(from[0], &c, 1) != 1 || c != 'x') {
+        printf("demandtest: cat did not echo\n");
+        exit(1);
+    }
+    close(from[0]);
+    *in = to[1];
+    return pid;
+}
+
+static void stop_cat(int pid, int in)
+{
+    int status;
+
+    close(in);
+    if (wait(&status) != pid || status != 0) {
+        printf("demandtest: cat failed\n");
+        exit(1);
+    }
+}
+
+// The page cache: a second exec of a program maps the text pages
+// the first read in, and they stay cached once both have exited.
+static void pcache_test(void)
+{
+    struct vmstat vs;
+    int in1, in2;
+
+    int pid1 = start_cat(&in1);
+    vmstat(&vs);
+    uint64 cached = vs.events[VT_LOADCACHED];
+    int pid2 = start_cat(&in2);
+    stop_cat(pid2, in2);
+    vmstat(&vs);
+    if (vs.events[VT_LOADCACHED] == cached) {
+        printf("demandtest: second cat did not share the first's text\n");
+        exit(1);
+    }
+    printf("pcache: %d text pages shared between two execs\n",
+           (int)(vs.events[VT_LOADCACHED] - cached));
+
+    stop_cat(pid1, in1);
+    vmstat(&vs);
+    cached = vs.events[VT_LOADCACHED];
+    pid2 = start_cat(&in2);
+    stop_cat(pid2, in2);
+    vmstat(&vs);
+    if (vs.events[VT_LOADCACHED] == cached) {
+        printf("demandtest: text left the cache when cat exited\n");
+        exit(1);
+    }
+    printf("pcache: text still cached after both exited\n");
+}
+
+// What zswap_test puts in page i: even pages are one value
+// over and over, odd ones text that compresses well.
+static char zswap_byte(int i, int off)
+{
+    if (i % 2 == 0)
+        return 'a' + i % 26;
+    return "compressible text, page "[off % 24] + (off / 24 == i % 7);
+}
+
+// More pages than the resident set holds go out to swap by way of
+// the compressed cache, same-filled and compressible ones both,
+// and come back intact.
+static void zswap_test(void)
+{
+    int n = 96;
+    struct vmstat before, vs;
+    char *heap = sbrklazy(n * PAGE_SIZE);
+
+    vmstat(&before);
+    for (int i = 0; i < n; i++)
+        for (int off = 0; off < PAGE_SIZE; off++)
+            heap[i * PAGE_SIZE + off] = zswap_byte(i, off);
+    vmstat(&vs);
+    if (vs.zswap_stores == before.zswap_stores || vs.zswap_same == 0 ||
+        vs.zswap_pages == vs.zswap_same) {
+        printf("demandtest: compressed cache holds %d pages, %d same-filled\n",
+               vs.zswap_pages, vs.zswap_same);
+        exit(1);
+    }
+    printf("zswap: %d pages cached, %d of them same-filled\n",
+           vs.zswap_pages, vs.zswap_same);
+
+    for (int i = 0; i < n; i++) {
+        for (int off = 0; off < PAGE_SIZE; off++) {
+            if (heap[i * PAGE_SIZE + off] != zswap_byte(i, off)) {
+                printf("demandtest: page %d byte %d lost its contents\n", i, off);
+                exit(1);
+            }
+        }
+    }
+    vmstat(&vs);
+    if (vs.zswap_loads == before.zswap_loads) {
+        printf("demandtest: no page came back from the compressed cache\n");
+        exit(1);
+    }
+    printf("zswap: %d pages read back from the cache, intact\n",
+           (int)(vs.zswap_loads - before.zswap_loads));
+}
+
+// What readahead_test puts in byte off of page i: a pseudo-random
+// sequence seeded by the page, which won't compress.
+static char noise(int i, int off)
+{
+    uint x = (i + 1) * 2654435761U + off * 40503U;
+
+    x ^= x >> 15;
+    x *= 2246822519U;
+    x ^= x >> 13;
+    return x >> 24;
+}
+
+// Swap-in readahead: pages written out in order go to disk slots
+// in order, and reading them back in order brings in their
+// neighbours ahead of use, which the process's readahead counters
+// record. The pages don't compress, so the compressed cache turns
+// them away and they really are read from the disk.
+static void readahead_test(void)
+{
+    int n = 96;
+    struct proc_mem_stat before, st;
+    struct vmstat vs0, vs;
+    char *heap = sbrklazy(n * PAGE_SIZE);
+
+    vmstat(&vs0);
+    for (int i = 0; i < n; i++)
+        for (int off = 0; off < PAGE_SIZE; off++)
+            heap[i * PAGE_SIZE + off] = noise(i, off);
+    vmstat(&vs);
+    memstat(&before, 0, 0, 0);
+    if (vs.zswap_rejects == vs0.zswap_rejects || before.num_swapped_pages == 0) {
+        printf("demandtest: no page went to the disk\n");
+        exit(1);
+    }
+    for (int i = 0; i < n; i++) {
+        for (int off = 0; off < PAGE_SIZE; off++) {
+            if (heap[i * PAGE_SIZE + off] != noise(i, off)) {
+                printf("demandtest: page %d byte %d lost its contents\n", i, off);
+                exit(1);
+            }
+        }
+    }
+    memstat(&st, 0, 0, 0);
+    if (st.readahead_hits == before.readahead_hits) {
+        printf("demandtest: no readahead hits (%d misses, window %d)\n",
+               st.readahead_misses - before.readahead_misses, st.readahead_window);
+        exit(1);
+    }
+    printf("readahead: %d pages from the disk used, %d wasted, window %d\n",
+           st.readahead_hits - before.readahead_hits,
+           st.readahead_misses - before.readahead_misses, st.readahead_window);
+}
+
+// kswapd: with memory held by sleeping processes, a fault that
+// finds free frames below the low watermark wakes kswapd, which
+// evicts until the high watermark is free. setwatermarks() won't
+// take a low watermark at or above the high one.
+static void kswapd_test(void)
+{
+    int nproc = 6, npages = 60, ready[2], hold[2];
+    struct vmstat saved, vs;
+    char c;
+
+    vmstat(&saved);
+    if (setwatermarks(20, 10, 4) == 0 || setwatermarks(20, 20, 4) == 0) {
+        printf("demandtest: setwatermarks accepted low >= high\n");
+        exit(1);
+    }
+    if (pipe(ready) < 0 || pipe(hold) < 0) {
+        printf("demandtest: pipe failed\n");
+        exit(1);
+    }
+    for (int i = 0; i < nproc; i++) {
+        int pid = fork();
+        if (pid < 0) {
+            printf("demandtest: fork failed\n");
+            exit(1);
+        }
+        if (pid == 0) {
+            char *heap = sbrklazy(npages * PAGE_SIZE);
+            for (int j = 0; j < npages; j++)
+                heap[j * PAGE_SIZE] = j;
+            close(hold[1]);
+            write(ready[1], "r", 1);
+            read(hold[0], &c, 1);  // until the parent is done
+            exit(0);
+        }
+    }
+    for (int i = 0; i < nproc; i++)
+        read(ready[0], &c, 1);
+    pause(5);
+
+    // Raise the watermarks over what is free, and fault once
+    vmstat(&vs);
+    int low = vs.free_frames + 1, high = vs.free_frames + 30;
+    if (setwatermarks(low, high, 4) < 0) {
+        printf("demandtest: %d frames free; memory is not full\n", vs.free_frames);
+        exit(1);
+    }
+    uint64 wakeups = vs.kswapd_wakeups;
+    char *page = sbrklazy(PAGE_SIZE);
+    page[0] = 1;
+    pause(5);
+    vmstat(&vs);
+    setwatermarks(saved.free_low, saved.free_high, saved.evict_batch);
+    close(hold[1]);
+    for (int i = 0; i < nproc; i++)
+        wait(0);
+
+    if (vs.kswapd_wakeups == wakeups || vs.free_frames < high - 1) {
+        printf("demandtest: kswapd woken %d times, %d frames free, not %d\n",
+               (int)(vs.kswapd_wakeups - wakeups), vs.free_frames, high);
+        exit(1);
+    }
+    printf("kswapd: reclaimed to %d free frames (high watermark %d)\n",
+           vs.free_frames, high);
+}
+
+// Fork nproc children that each fill npages pages, more than
+// their resident sets hold, passes times over, and check them;
+// together they run memory dry. Exits if any child fails.
+static void hogs(int nproc, int npages, int passes)
+{
+    for (int c = 0; c < nproc; c++) {
+        int pid = fork();
+        if (pid < 0) {
+            printf("demandtest: fork failed\n");
+            exit(1);
+        }
+        if (pid == 0) {
+            char *heap = sbrklazy(npages * PAGE_SIZE);
+            for (int pass = 0; pass < passes; pass++) {
+                for (int i = 0; i < npages; i++)
+                    heap[i * PAGE_SIZE] = c * 16 + pass + i;
+                for (int i = 0; i < npages; i++) {
+                    if (heap[i * PAGE_SIZE] != (char)(c * 16 + pass + i)) {
+                        printf("demandtest: child %d page %d lost its contents\n", c, i);
+                        exit(1);
+                    }
+                }
+            }
+            exit(0);
+        }
+    }
+    for (int c = 0; c < nproc; c++) {
+        int status;
+        if (wait(&status) < 0 || status != 0) {
+            printf("demandtest: a child failed\n");
+            exit(1);
+        }
+    }
+}
+
+// The resident-set limit, as page-fault frequency has set it
+static int rss_limit(void)
+{
+    struct proc_mem_stat st;
+
+    memstat(&st, 0, 0, 0);
+    return st.resident_limit;
+}
+
+// Page-fault frequency: rapid faults raise a process's limit, a
+// quiet spell lowers it at the next fault, and a process filling
+// memory replaces its own pages rather than a small one's.
+static void pff_test(void)
+{
+    int n = 160, small = 8, ready[2], go[2];
+    char c;
+
+    int before = rss_limit();
+    char *heap = sbrklazy(n * PAGE_SIZE);
+    for (int i = 0; i < n; i++)
+        heap[i * PAGE_SIZE] = i;
+    int busy = rss_limit();
+    if (busy <= before) {
+        printf("demandtest: limit %d after rapid faults, was %d\n", busy, before);
+        exit(1);
+    }
+    printf("pff: limit %d -> %d while faulting\n", before, busy);
+
+    pause(5);
+    heap = sbrklazy(PAGE_SIZE);
+    heap[0] = 1;  // the first fault after the quiet spell
+    int quiet = rss_limit();
+    if (quiet >= busy) {
+        printf("demandtest: limit %d after a quiet spell, was %d\n", quiet, busy);
+        exit(1);
+    }
+    printf("pff: limit %d -> %d after a quiet spell\n", busy, quiet);
+
+    if (pipe(ready) < 0 || pipe(go) < 0) {
+        printf("demandtest: pipe failed\n");
+        exit(1);
+    }
+    int pid = fork();
+    if (pid == 0) {
+        struct proc_mem_stat st;
+        struct page_stat ps[8];
+        char *ws = sbrklazy(small * PAGE_SIZE);
+        for (int i = 0; i < small; i++)
+            ws[i * PAGE_SIZE] = i;
+        write(ready[1], "r", 1);
+        read(go[0], &c, 1);
+        int n = memstat(&st, ps, small, (uint64)ws);
+        for (int i = 0; i < small; i++)
+            if (i >= n || ps[i].state != RESIDENT)
+                exit(1);
+        exit(0);
+    }
+    read(ready[0], &c, 1);
+    int hog = n * 2;
+    heap = sbrklazy(hog * PAGE_SIZE);
+    for (int pass = 0; pass < 2; pass++)
+        for (int i = 0; i < hog; i++)
+            heap[i * PAGE_SIZE] = pass + i;
+    write(go[1], "g", 1);
+    int status;
+    wait(&status);
+    if (status != 0) {
+        printf("demandtest: a %d-page hog pushed out a %d-page working set\n", hog, small);
+        exit(1);
+    }
+    printf("pff: a %d-page hog with limit %d left a %d-page working set resident\n",
+           hog, rss_limit(), small);
+}
+
+// Several processes run memory dry together, so that global
+// replacement takes pages from one to give to another while
+// swap writes finish and wake the faults waiting on them.
+static void stress_test(void)
+{
+    int nproc = 6, npages = 80;
+
+    hogs(nproc, npages, 3);
+    printf("stress: %d processes, %d pages each, intact\n", nproc, npages);
+}
+
+// Grow the heap to a 2 MiB boundary and a 2 MiB block past it;
+// returns the block.
+static char *mega_block(void)
+{
+    uint64 cur = (uint64)sbrk(0);
+    uint64 base = (cur + MEGA_SIZE - 1) & ~(uint64)(MEGA_SIZE - 1);
+
+    sbrklazy(base + MEGA_SIZE - cur);
+    return (char*)base;
+}
+
+// Run hogs() with kswapd all but off and global replacement
+// evicting batch pages at a time; returns how often a fault
+// found memory full.
+static int memfull_faults(int batch)
+{
+    struct vmstat before, vs;
+
+    if (setwatermarks(1, 2, batch) < 0) {
+        printf("demandtest: setwatermarks(1, 2, %d) failed\n", batch);
+        exit(1);
+    }
+    vmstat(&before);
+    hogs(8, 80, 2);
+    vmstat(&vs);
+    return vs.events[VT_MEMFULL] - before.events[VT_MEMFULL];
+}
+
+// Batched eviction: a fault that finds memory full evicts a batch
+// of pages and keeps the spares, so with the same load fewer faults
+// find it full than when each evicts one page; the pages come back
+// intact either way.
+static void batch_test(void)
+{
+    struct vmstat saved;
+
+    vmstat(&saved);
+    int one = memfull_faults(1);
+    int batched = memfull_faults(saved.evict_batch > 1 ? saved.evict_batch : 4);
+    setwatermarks(saved.free_low, saved.free_high, saved.evict_batch);
+    printf("batch: memory full at %d faults a page at a time, %d batched\n",
+           one, batched);
+    if (one == 0) {
+        printf("demandtest: memory never ran full\n");
+        exit(1);
+    }
+    if (batched >= one) {
+        printf("demandtest: batched eviction saved no full-memory faults\n");
+        exit(1);
+    }
+}
+
+// A megapage counts against the resident-set limit: a process
+// whose limit can't hold one gets pages, and one whose rapid
+// faults have raised its limit enough gets a 2 MiB-aligned heap
+// block mapped with one megapage. When other processes run
+// memory dry, replacement splits it and writes its pages out,
+// and they come back intact.
+static void megapage_test(void)
+{
+    struct vmstat vs;
+    struct proc_mem_stat st;
+    struct page_stat ps[64];
+    int npages = MEGA_SIZE / PAGE_SIZE, swapped = 0;
+
+    pause(10);  // time for kzerod to clear a megapage
+    vmstat(&vs);
+    uint64 before = vs.events[VT_MEGAPAGE];
+    int pid = fork();
+    if (pid == 0) {
+        mega_block()[0] = 1;
+        vmstat(&vs);
+        exit(vs.events[VT_MEGAPAGE] != before);
+    }
+    int status;
+    wait(&status);
+    if (status != 0) {
+        printf("demandtest: megapage mapped beyond the resident-set limit\n");
+        exit(1);
+    }
+    printf("megapage: none within the default limit\n");
+
+    int nwarm = npages + 128;
+    char *warm = sbrklazy(nwarm * PAGE_SIZE);
+    for (int i = 0; i < nwarm; i++)
+        warm[i * PAGE_SIZE] = 1;
+    memstat(&st, 0, 0, 0);
+    if (st.resident_limit < npages) {
+        printf("demandtest: limit only %d after %d rapid faults\n",
+               st.resident_limit, nwarm);
+        exit(1);
+    }
+    char *block = mega_block();
+    uint64 base = (uint64)block;
+    for (int i = 0; i < npages; i++) {
+        block[i * PAGE_SIZE] = i * 7 + 1;
+        block[i * PAGE_SIZE + PAGE_SIZE - 1] = i * 5 + 3;
+    }
+    vmstat(&vs);
+    if (vs.events[VT_MEGAPAGE] == before) {
+        printf("demandtest: no megapage mapped\n");
+        exit(1);
+    }
+    printf("megapage: mapped at %p\n", block);
+
+    hogs(8, 80, 2);
+
+    for (uint64 va = base; va != 0 && va < base + MEGA_SIZE; va = st.next_va) {
+        int n = memstat(&st, ps, 64, va);
+        for (int i = 0; i < n; i++)
+            if (ps[i].va < base + MEGA_SIZE && ps[i].state == SWAPPED)
+                swapped++;
+    }
+    if (swapped == 0) {
+        printf("demandtest: no page of the megapage went to swap\n");
+        exit(1);
+    }
+    for (int i = 0; i < npages; i++) {
+        if (block[i * PAGE_SIZE] != (char)(i * 7 + 1) ||
+            block[i * PAGE_SIZE + PAGE_SIZE - 1] != (char)(i * 5 + 3)) {
+            printf("demandtest: megapage page %d lost its contents\n", i);
+            exit(1);
+        }
+    }
+    printf("megapage: %d of %d pages swapped out, all intact\n", swapped, npages);
+}
+
+// Modes that run one test and exit
+static struct {
+    char *name;
+    void (*fn)(void);
+} tests[] = {
+    { "advise", advise_test },
+    { "mmap", mmap_test },
+    { "faultaround", faultaround_test },
+    { "stress", stress_test },
+    { "pff", pff_test },
+    { "megapage", megapage_test },
+    { "cow", cow_test },
+    { "pcache", pcache_test },
+    { "zswap", zswap_test },
+    { "readahead", readahead_test },
+    { "kswapd", kswapd_test },
+    { "batch", batch_test },
+};
 
 int main(int argc, char *argv[])
 {
@@ -10,6 +864,17 @@ int main(int argc, char *argv[])
     int swap_test = 0;
     int num_swap_pages = 20; // for swap/FIFO test
 
+    if (argc > 1) {
+        for (int i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+            if (strcmp(argv[1], tests[i].name) == 0) {
+                printf("demandtest: starting test (mode: %s)\n", tests[i].name);
+                tests[i].fn();
+                printf("demandtest: finished\n");
+                exit(0);
+            }
+        }
+    }
+
     // -----------------------------
     // Parse arguments
     // -----------------------------
@@ -40,10 +905,15 @@ int main(int argc, char *argv[])
             printf("Touched heap page %d\n", i);
         }
 
-        // Re-access first few pages to trigger SWAPIN
+        // Re-access first few pages to trigger SWAPIN; swapped
+        // pages must come back with their contents
         for (int i = 0; i < 5; i++) {
             char c = heap[i * PAGE_SIZE];
             printf("Re-accessed heap page %d, value=%c\n", i, c);
+            if (c != 'A' + (i % 26)) {
+                printf("demandtest: page %d lost its contents\n", i);
+                exit(1);
+            }
         }
     } else {
         // Small heap test for SAFE/FULL
@@ -0,0 +1,30 @@
+#include "kernel/types.h"
+#include "kernel/memstat.h"
+#include "user/user.h"
+
+// Show how many free physical pages each hart's
+// free list holds, the shared pool, and the pool
+// of pages kept ready zeroed.
+
+int
+main(int argc, char *argv[])
+{
+  struct kalloc_stat st;
+  int total = 0;
+
+  if(kallocstat(&st) < 0){
+    fprintf(2, "free: kallocstat failed\n");
+    exit(1);
+  }
+  for(int i = 0; i < st.ncpu; i++){
+    if(st.nfree[i] > 0)
+      printf("cpu%d\t%d\n", i, st.nfree[i]);
+    total += st.nfree[i];
+  }
+  printf("pool\t%d\n", st.npool);
+  total += st.npool;
+  printf("zeroed\t%d\n", st.nzero);
+  total += st.nzero;
+  printf("total\t%d pages, %d steals\n", total, st.nsteal);
+  exit(0);
+}
@@ -1,10 +1,15 @@
 #include "kernel/types.h"
 #include "kernel/memstat.h"
+#include "kernel/vmtrace.h"
 #include "user/user.h"
 
 int main() {
   printf("Demand Paging Test\n");
   
+  struct vmstat vs;
+  vmstat(&vs);
+  uint64 heap_faults = vs.faults[VT_HEAP];
+  
   // Test lazy sbrk allocation
   char *p = sbrklazy(4096 * 2);
   if(p == (char*)-1) {
@@ -25,16 +30,49 @@ int main() {
   p[4096 + 100] = 'D';
   printf("Second page written\n");
   
+  // Both were faults on the heap
+  vmstat(&vs);
+  if(vs.faults[VT_HEAP] - heap_faults < 2) {
+    printf("heap faults not counted as such\n");
+    exit(1);
+  }
+  
   // Test memstat system call
   struct proc_mem_stat stat;
-  if(memstat(&stat) == 0) {
-    printf("memstat: PID=%d resident=%d swapped=%d total=%d next_seq=%d\n", 
-           stat.pid, stat.num_resident_pages, stat.num_swapped_pages,
-           stat.num_pages_total, stat.next_fifo_seq);
+  if(memstat(&stat, 0, 0, 0) == 0) {
+    printf("memstat: PID=%d resident=%d (limit %d) swapped=%d total=%d next_seq=%d\n", 
+           stat.pid, stat.num_resident_pages, stat.resident_limit,
+           stat.num_swapped_pages, stat.num_pages_total, stat.next_fifo_seq);
   } else {
     printf("memstat failed\n");
   }
   
+  // Page through every mapped page, a few at a time
+  struct page_stat pages[8];
+  int nres = 0, nswap = 0, found = 0;
+  uint64 va = 0;
+  do {
+    int n = memstat(&stat, pages, 8, va);
+    if(n < 0) {
+      printf("memstat failed\n");
+      exit(1);
+    }
+    for(int i = 0; i < n; i++) {
+      if(pages[i].state == RESIDENT)
+        nres++;
+      else if(pages[i].state == SWAPPED)
+        nswap++;
+      if(pages[i].va == (uint64)p && pages[i].is_dirty)
+        found = 1;
+    }
+    va = stat.next_va;
+  } while(va != 0);
+  printf("memstat pages: resident=%d swapped=%d\n", nres, nswap);
+  if(!found) {
+    printf("memstat: dirty heap page at %p not reported\n", p);
+    exit(1);
+  }
+  
   printf("Test completed\n");
   exit(0);
 }
\ No newline at end of file
@@ -2,6 +2,11 @@
 
 struct stat;
 struct proc_mem_stat;
+struct page_stat;
+struct kalloc_stat;
+struct vmtrace_rec;
+struct vmstat;
+struct faultlat;
 
 // system calls
 int fork(void);
@@ -25,7 +30,17 @@ int getpid(void);
 char* sys_sbrk(int,int);
 int pause(int);
 int uptime(void);
-int memstat(struct proc_mem_stat*);
+int memstat(struct proc_mem_stat*, struct page_stat*, int, uint64);
+int setpolicy(int, int);
+int setfaultaround(int, int);
+int kallocstat(struct kalloc_stat*);
+int vmtrace(struct vmtrace_rec*, int);
+int vmverbose(int);
+int vmstat(struct vmstat*);
+int faultlat(struct faultlat*);
+int setwatermarks(int, int, int);
+int madvise(void*, int, int);
+void* mmap(int, int, int, int, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -43,3 +43,13 @@ entry("sbrk");
 entry("pause");
 entry("uptime");
 entry("memstat");
+entry("setpolicy");
+entry("setfaultaround");
+entry("kallocstat");
+entry("vmtrace");
+entry("vmverbose");
+entry("vmstat");
+entry("faultlat");
+entry("setwatermarks");
+entry("madvise");
+entry("mmap");
@@ -0,0 +1,174 @@
+#include "kernel/types.h"
+#include "kernel/vmtrace.h"
+#include "user/user.h"
+
+// Show system-wide paging activity.
+//
+//   vmstat                 totals since boot
+//   vmstat ticks [count]   one line per interval of ticks: free
+//                          frames and swap slots in use, then what
+//                          happened during the interval
+//   vmstat -l              how long faults have taken to serve
+//   vmstat -w low high [batch]
+//                          set the free-frame watermarks kswapd
+//                          keeps between, and how many pages are
+//                          evicted at once
+
+static void
+get(struct vmstat *st)
+{
+  if(vmstat(st) < 0){
+    fprintf(2, "vmstat: vmstat failed\n");
+    exit(1);
+  }
+}
+
+// Pages newly allocated by the fault handler
+static uint64
+allocs(struct vmstat *st)
+{
+  return st->events[VT_ALLOC] + st->events[VT_LOADEXEC] + st->events[VT_COW] +
+         st->events[VT_MEGAPAGE];
+}
+
+static void
+totals(void)
+{
+  struct vmstat st;
+
+  get(&st);
+  printf("frames      %d free of %d\n", st.free_frames, st.nframe);
+  printf("swap        %d slots used of %d\n", st.swap_used, st.swap_slots);
+  printf("faults      text %lu data %lu heap %lu stack %lu swap %lu mmap %lu invalid %lu\n",
+         st.faults[VT_TEXT], st.faults[VT_DATA], st.faults[VT_HEAP],
+         st.faults[VT_STACK], st.faults[VT_SWAP], st.faults[VT_MMAP],
+         st.faults[VT_INVALID]);
+  printf("allocs      %lu zero-fill %lu file %lu cow %lu megapage %lu (cached %lu)\n",
+         allocs(&st), st.events[VT_ALLOC], st.events[VT_LOADEXEC],
+         st.events[VT_COW], st.events[VT_MEGAPAGE], st.events[VT_LOADCACHED]);
+  printf("evictions   clean %lu dirty %lu\n",
+         st.events[VT_EVICT] - st.dirty_evicts, st.dirty_evicts);
+  printf("swap i/o    out %lu in %lu\n", st.events[VT_SWAPOUT], st.events[VT_SWAPIN]);
+  printf("zswap       %d pages in %d frames, %d same-filled",
+         st.zswap_pages, st.zswap_frames, st.zswap_same);
+  if(st.zswap_bytes > 0){
+    // compression ratio of the rest, to a tenth
+    uint64 r = (uint64)(st.zswap_pages - st.zswap_same) * 4096 * 10 / st.zswap_bytes;
+    printf(", ratio %lu.%lu", r / 10, r % 10);
+  }
+  printf("\n");
+  printf("zswap i/o   stored %lu loaded %lu rejected %lu written back %lu\n",
+         st.zswap_stores, st.zswap_loads, st.zswap_rejects, st.zswap_writebacks);
+  printf("kswapd      woken %lu freed %lu (watermarks %d-%d, batch %d)\n",
+         st.kswapd_wakeups, st.kswapd_pages, st.free_low, st.free_high,
+         st.evict_batch);
+  printf("kills       %lu\n", st.events[VT_KILL]);
+}
+
+static char *ftypes[NFTYPE] = {
+[FT_ZERO]   "zero",
+[FT_EXEC]   "exec",
+[FT_SWAPIN] "swapin",
+[FT_EVICT]  "evict",
+[FT_OTHER]  "other",
+};
+
+static struct faultlat lat;
+
+// Fault service times: a row per latency bucket that any
+// fault fell into, a column per fault type
+static void
+latency(void)
+{
+  if(faultlat(&lat) < 0){
+    fprintf(2, "vmstat: faultlat failed\n");
+    exit(1);
+  }
+  printf("from(us)");
+  for(int t = 0; t < NFTYPE; t++)
+    printf("\t%s", ftypes[t]);
+  printf("\n");
+  for(int b = 0; b < NLATBUCKET; b++){
+    uint64 n = 0;
+    for(int t = 0; t < NFTYPE; t++)
+      n += lat.hist[t][b];
+    if(n == 0)
+      continue;
+    // a time CSR tick is 100ns
+    uint64 ns = b == 0 ? 0 : (1UL << b) * 100;
+    printf("%lu.%lu", ns / 1000, (ns % 1000) / 100);
+    for(int t = 0; t < NFTYPE; t++)
+      printf("\t%lu", lat.hist[t][b]);
+    printf("\n");
+  }
+}
+
+static void
+header(void)
+{
+  printf(" free  swap | text data heap stack swap mmap inval | alloc | evcl evdt | swpo swpi | kill\n");
+}
+
+// One line of activity between old and new
+static void
+line(struct vmstat *old, struct vmstat *new)
+{
+  printf("%d %d | %lu %lu %lu %lu %lu %lu %lu | %lu | %lu %lu | %lu %lu | %lu\n",
+         new->free_frames, new->swap_used,
+         new->faults[VT_TEXT] - old->faults[VT_TEXT],
+         new->faults[VT_DATA] - old->faults[VT_DATA],
+         new->faults[VT_HEAP] - old->faults[VT_HEAP],
+         new->faults[VT_STACK] - old->faults[VT_STACK],
+         new->faults[VT_SWAP] - old->faults[VT_SWAP],
+         new->faults[VT_MMAP] - old->faults[VT_MMAP],
+         new->faults[VT_INVALID] - old->faults[VT_INVALID],
+         allocs(new) - allocs(old),
+         (new->events[VT_EVICT] - new->dirty_evicts) - (old->events[VT_EVICT] - old->dirty_evicts),
+         new->dirty_evicts - old->dirty_evicts,
+         new->events[VT_SWAPOUT] - old->events[VT_SWAPOUT],
+         new->events[VT_SWAPIN] - old->events[VT_SWAPIN],
+         new->events[VT_KILL] - old->events[VT_KILL]);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct vmstat old, new;
+  int interval, count = -1;
+
+  if(argc < 2){
+    totals();
+    exit(0);
+  }
+  if(argc == 2 && strcmp(argv[1], "-l") == 0){
+    latency();
+    exit(0);
+  }
+  if((argc == 4 || argc == 5) && strcmp(argv[1], "-w") == 0){
+    get(&old);
+    if(setwatermarks(atoi(argv[2]), atoi(argv[3]),
+                     argc == 5 ? atoi(argv[4]) : old.evict_batch) < 0){
+      fprintf(2, "vmstat: bad watermarks\n");
+      exit(1);
+    }
+    exit(0);
+  }
+  interval = atoi(argv[1]);
+  if(argc > 2)
+    count = atoi(argv[2]);
+  if(interval <= 0 || argc > 3){
+    fprintf(2, "usage: vmstat [-l | -w low high [batch] | ticks [count]]\n");
+    exit(1);
+  }
+
+  get(&old);
+  for(int i = 0; count < 0 || i < count; i++){
+    if(i % 20 == 0)
+      header();
+    pause(interval);
+    get(&new);
+    line(&old, &new);
+    old = new;
+  }
+  exit(0);
+}
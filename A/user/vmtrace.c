@@ -0,0 +1,121 @@
+#include "kernel/types.h"
+#define VT_NAMES
+#include "kernel/vmtrace.h"
+#include "user/user.h"
+
+// Print the kernel's paging events, in the format the console
+// log uses in verbose mode.
+//
+//   vmtrace              print (and so remove) the events recorded
+//   vmtrace cmd args...  discard them, run cmd, then print the
+//                        events of its process
+//   vmtrace -v on|off    also print events on the console, or not
+
+#define NREC 32
+
+static struct vmtrace_rec recs[NREC];
+
+static void
+print(struct vmtrace_rec *e)
+{
+  char *name;
+
+  if(e->event <= 0 || e->event >= NVTEVENT){
+    printf("[pid %d] event %d va=0x%lx\n", e->pid, e->event, e->va);
+    return;
+  }
+  name = vt_events[e->event];
+  switch(e->event){
+  case VT_PAGEFAULT:
+    printf("[pid %d] %s va=0x%lx access=%s cause=%s\n", e->pid, name, e->va,
+           vt_accesses[e->a], vt_causes[e->b]);
+    break;
+  case VT_RESIDENT:
+    printf("[pid %d] %s va=0x%lx seq=%d\n", e->pid, name, e->va, e->a);
+    break;
+  case VT_VICTIM:
+    printf("[pid %d] %s va=0x%lx seq=%d algo=%s\n", e->pid, name, e->va, e->a, vt_algos[e->b]);
+    break;
+  case VT_EVICT:
+    printf("[pid %d] %s va=0x%lx state=%s\n", e->pid, name, e->va, e->a ? "dirty" : "clean");
+    break;
+  case VT_SWAPOUT:
+    printf("[pid %d] %s va=0x%lx slot=%d%s\n", e->pid, name, e->va, e->a, e->b ? " clean" : "");
+    break;
+  case VT_SWAPIN:
+    printf("[pid %d] %s va=0x%lx slot=%d\n", e->pid, name, e->va, e->a);
+    break;
+  case VT_FAULTAROUND:
+  case VT_READAHEAD:
+    printf("[pid %d] %s va=0x%lx npages=%d\n", e->pid, name, e->va, e->a);
+    break;
+  case VT_SWAPFULL:
+  case VT_MEMFULL:
+    printf("[pid %d] %s\n", e->pid, name);
+    break;
+  case VT_KILL:
+    printf("[pid %d] %s %s va=0x%lx", e->pid, name, vt_kills[e->a], e->va);
+    if(e->a == VK_ACCESS)
+      printf(" access=%s", vt_accesses[e->b]);
+    else if(e->a == VK_BADCAUSE || e->a == VK_NOSEGMENT || e->a == VK_LOADFAIL)
+      printf(" cause=%s", vt_causes[e->b]);
+    else if(e->a == VK_SWAPIN)
+      printf(" slot=%d", e->b);
+    printf("\n");
+    break;
+  case VT_LOST:
+    printf("[cpu %d] %s %d events\n", e->cpu, name, e->a);
+    break;
+  default:
+    printf("[pid %d] %s va=0x%lx\n", e->pid, name, e->va);
+    break;
+  }
+}
+
+// Read out all recorded events, printing them if show is set:
+// only process pid's, unless pid is 0. Lost events always are.
+static void
+drain(int show, int pid)
+{
+  int n;
+
+  while((n = vmtrace(recs, NREC)) > 0)
+    for(int i = 0; show && i < n; i++)
+      if(pid == 0 || recs[i].pid == pid || recs[i].event == VT_LOST)
+        print(&recs[i]);
+  if(n < 0){
+    fprintf(2, "vmtrace: vmtrace failed\n");
+    exit(1);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  if(argc == 3 && strcmp(argv[1], "-v") == 0){
+    vmverbose(strcmp(argv[2], "on") == 0);
+    exit(0);
+  }
+  if(argc > 1 && argv[1][0] == '-'){
+    fprintf(2, "usage: vmtrace [-v on|off] [cmd args...]\n");
+    exit(1);
+  }
+
+  int pid = 0;
+  if(argc > 1){
+    drain(0, 0);
+    pid = fork();
+    if(pid < 0){
+      fprintf(2, "vmtrace: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      exec(argv[1], argv + 1);
+      fprintf(2, "vmtrace: exec %s failed\n", argv[1]);
+      exit(1);
+    }
+    wait(0);
+  }
+  drain(1, pid);
+  exit(0);
+}